@@ -1,19 +1,42 @@
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "blosc2.h"
 #include "blosc2_entropy_prober.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define B2EP_X86
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define B2EP_NEON
+#endif
+
+
+// minlen and ipshift are decent defaults, but one can try
+// with (4, 4) or (3, 4) or (4, 3)
+#define DEFAULT_MINLEN 3
+#define DEFAULT_IPSHIFT 3
 
 #define MAX_COPY 32U
 #define MAX_DISTANCE 8191
 #define MAX_FARDISTANCE (65535 + MAX_DISTANCE - 1)
 
-// The hash length (1 << HASH_LOG2) can be tuned for performance (12 -> 15)
-#define HASH_LOG2 (12U)
-// #define HASH_LOG2 (13U)
-// #define HASH_LOG2 (14U)
+// The hash length (1 << hash_log2) can be tuned for performance (12 -> 15).
+// This is also the size of the windows probed, as get_csize() does not look further.
+#define DEFAULT_HASH_LOG2 B2EP_MIN_HASH_LOG2
+
+#if defined(__GNUC__)
+#define B2EP_ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define B2EP_ALWAYS_INLINE __forceinline
+#else
+#define B2EP_ALWAYS_INLINE inline
+#endif
 
 #define HASH_FUNCTION(v, s, h)              \
     {                                       \
@@ -35,9 +58,8 @@
         }                          \
     }
 
-static uint8_t *get_run(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+static uint8_t *get_run_scalar(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref, uint8_t x)
 {
-    uint8_t x = ip[-1];
     int64_t value, value2;
     /* Broadcast the value for every byte in a 64-bit register */
     memset(&value, x, 8);
@@ -61,6 +83,11 @@ static uint8_t *get_run(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref
     return ip;
 }
 
+static uint8_t *get_run(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+{
+    return get_run_scalar(ip, ip_bound, ref, ip[-1]);
+}
+
 static uint8_t *get_match(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
 {
     while (ip < (ip_bound - sizeof(int64_t))) {
@@ -81,25 +108,163 @@ static uint8_t *get_match(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *r
     return ip;
 }
 
+/* The SIMD versions compare 16/32 bytes per step and find the first differing
+   byte with a ctz over the comparison mask.  Results are the same as the scalar
+   versions, which are used for the remainder. */
+#if defined(B2EP_X86)
+__attribute__((target("sse2")))
+static uint8_t *get_run_sse2(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+{
+    uint8_t x = ip[-1];
+    const __m128i value = _mm_set1_epi8((char)x);
+    while (ip < (ip_bound - sizeof(__m128i))) {
+        __m128i value2 = _mm_loadu_si128((const __m128i *)ref);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(value, value2)) ^ 0xFFFFU;
+        if (mask != 0) {
+            return ip + __builtin_ctz(mask);
+        }
+        ip += sizeof(__m128i);
+        ref += sizeof(__m128i);
+    }
+    return get_run_scalar(ip, ip_bound, ref, x);
+}
+
+__attribute__((target("sse2")))
+static uint8_t *get_match_sse2(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+{
+    while (ip < (ip_bound - sizeof(__m128i))) {
+        __m128i value = _mm_loadu_si128((const __m128i *)ip);
+        __m128i value2 = _mm_loadu_si128((const __m128i *)ref);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(value, value2)) ^ 0xFFFFU;
+        if (mask != 0) {
+            /* Like the scalar version, return one past the byte that starts to differ */
+            return ip + __builtin_ctz(mask) + 1;
+        }
+        ip += sizeof(__m128i);
+        ref += sizeof(__m128i);
+    }
+    return get_match(ip, ip_bound, ref);
+}
+
+__attribute__((target("avx2")))
+static uint8_t *get_run_avx2(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+{
+    uint8_t x = ip[-1];
+    const __m256i value = _mm256_set1_epi8((char)x);
+    while (ip < (ip_bound - sizeof(__m256i))) {
+        __m256i value2 = _mm256_loadu_si256((const __m256i *)ref);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(value, value2));
+        if (mask != 0) {
+            return ip + __builtin_ctz(mask);
+        }
+        ip += sizeof(__m256i);
+        ref += sizeof(__m256i);
+    }
+    return get_run_scalar(ip, ip_bound, ref, x);
+}
+
+__attribute__((target("avx2")))
+static uint8_t *get_match_avx2(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+{
+    while (ip < (ip_bound - sizeof(__m256i))) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)ip);
+        __m256i value2 = _mm256_loadu_si256((const __m256i *)ref);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(value, value2));
+        if (mask != 0) {
+            return ip + __builtin_ctz(mask) + 1;
+        }
+        ip += sizeof(__m256i);
+        ref += sizeof(__m256i);
+    }
+    return get_match(ip, ip_bound, ref);
+}
+#endif  /* B2EP_X86 */
+
+#if defined(B2EP_NEON)
+/* NEON has no movemask, so narrow the comparison to 4 bits per byte */
+static inline uint64_t neon_mismatch_mask(uint8x16_t value, uint8x16_t value2)
+{
+    uint8x16_t eq = vceqq_u8(value, value2);
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return ~vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+static uint8_t *get_run_neon(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+{
+    uint8_t x = ip[-1];
+    const uint8x16_t value = vdupq_n_u8(x);
+    while (ip < (ip_bound - sizeof(uint8x16_t))) {
+        uint64_t mask = neon_mismatch_mask(value, vld1q_u8(ref));
+        if (mask != 0) {
+            return ip + (__builtin_ctzll(mask) >> 2);
+        }
+        ip += sizeof(uint8x16_t);
+        ref += sizeof(uint8x16_t);
+    }
+    return get_run_scalar(ip, ip_bound, ref, x);
+}
+
+static uint8_t *get_match_neon(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref)
+{
+    while (ip < (ip_bound - sizeof(uint8x16_t))) {
+        uint64_t mask = neon_mismatch_mask(vld1q_u8(ip), vld1q_u8(ref));
+        if (mask != 0) {
+            return ip + (__builtin_ctzll(mask) >> 2) + 1;
+        }
+        ip += sizeof(uint8x16_t);
+        ref += sizeof(uint8x16_t);
+    }
+    return get_match(ip, ip_bound, ref);
+}
+#endif  /* B2EP_NEON */
+
+typedef uint8_t *(*run_or_match_fn)(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref);
+
+static run_or_match_fn get_run_impl = get_run;
+static run_or_match_fn get_match_impl = get_match;
+static pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+
+// Select the fastest run/match finders for the running CPU
+static void init_dispatch(void)
+{
+#if defined(B2EP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        get_run_impl = get_run_avx2;
+        get_match_impl = get_match_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        get_run_impl = get_run_sse2;
+        get_match_impl = get_match_sse2;
+    }
+#elif defined(B2EP_NEON)
+    get_run_impl = get_run_neon;
+    get_match_impl = get_match_neon;
+#endif
+}
+
 static uint8_t *get_run_or_match(uint8_t *ip, uint8_t *ip_bound, const uint8_t *ref, bool run)
 {
     if (run) {
-        ip = get_run(ip, ip_bound, ref);
+        ip = get_run_impl(ip, ip_bound, ref);
     }
     else {
-        ip = get_match(ip, ip_bound, ref);
+        ip = get_match_impl(ip, ip_bound, ref);
     }
 
     return ip;
 }
 
-// Get a guess for the compressed size of a buffer
-static float get_cratio(const uint8_t *ibase, int maxlen, int minlen, int ipshift)
+// Get a guess for the compressed size of a buffer, as the number of input
+// bytes looked at and the estimated output bytes for them.  This is always
+// inlined into get_csize_<hash_log2>(), so hash_log2 is a compile time constant.
+static B2EP_ALWAYS_INLINE void get_csize_generic(const uint8_t *ibase, int maxlen, int minlen, int ipshift,
+                                                 int32_t *ibytes, int32_t *obytes, const unsigned hash_log2)
 {
     const uint8_t *ip = ibase;
     int32_t oc = 0;
-    const uint16_t hashlen = (1U << (uint8_t)HASH_LOG2);
-    uint16_t htab[1U << (uint8_t)HASH_LOG2];
+    const uint16_t hashlen = (1U << (uint8_t)hash_log2);
+    uint16_t htab[1U << B2EP_MAX_HASH_LOG2];
     uint32_t hval;
     uint32_t seq;
     uint8_t copy;
@@ -123,7 +288,7 @@ static float get_cratio(const uint8_t *ibase, int maxlen, int minlen, int ipshif
 
         /* find potential match */
         seq = BLOSCLZ_READU32(ip);
-        HASH_FUNCTION(hval, seq, HASH_LOG2)
+        HASH_FUNCTION(hval, seq, hash_log2)
         ref = ibase + htab[hval];
 
         /* calculate distance to the match */
@@ -186,15 +351,43 @@ static float get_cratio(const uint8_t *ibase, int maxlen, int minlen, int ipshif
 
         /* update the hash at match boundary */
         seq = BLOSCLZ_READU32(ip);
-        HASH_FUNCTION(hval, seq, HASH_LOG2)
+        HASH_FUNCTION(hval, seq, hash_log2)
         htab[hval] = (uint16_t)(ip++ - ibase);
         ip++;
         /* assuming literal copy */
         oc++;
     }
 
-    float ic = (float)(ip - ibase);
-    return ic / (float)oc;
+    *ibytes = (int32_t)(ip - ibase);
+    *obytes = oc;
+}
+
+typedef void (*get_csize_fn)(const uint8_t *ibase, int maxlen, int minlen, int ipshift,
+                             int32_t *ibytes, int32_t *obytes);
+
+#define DEFINE_GET_CSIZE(hash_log2)                                                      \
+    static void get_csize_##hash_log2(const uint8_t *ibase, int maxlen, int minlen,      \
+                                      int ipshift, int32_t *ibytes, int32_t *obytes)     \
+    {                                                                                    \
+        get_csize_generic(ibase, maxlen, minlen, ipshift, ibytes, obytes, hash_log2##U); \
+    }
+
+DEFINE_GET_CSIZE(12)
+DEFINE_GET_CSIZE(13)
+DEFINE_GET_CSIZE(14)
+DEFINE_GET_CSIZE(15)
+
+// Specialized kernels, indexed by hash_log2 - B2EP_MIN_HASH_LOG2
+static const get_csize_fn get_csize_kernels[B2EP_MAX_HASH_LOG2 - B2EP_MIN_HASH_LOG2 + 1] = {
+    get_csize_12, get_csize_13, get_csize_14, get_csize_15,
+};
+
+// Get a guess for the compression ratio of a buffer
+static float get_cratio(const uint8_t *ibase, int maxlen, int hash_log2, int minlen, int ipshift)
+{
+    int32_t ic, oc;
+    get_csize_kernels[hash_log2 - B2EP_MIN_HASH_LOG2](ibase, maxlen, minlen, ipshift, &ic, &oc);
+    return (float)ic / (float)oc;
 }
 
 static int encoder(const uint8_t *input, int32_t input_len,
@@ -202,9 +395,9 @@ static int encoder(const uint8_t *input, int32_t input_len,
                    uint8_t meta,
                    blosc2_cparams *cparams, const void *chunk)
 {
-    // Get the cratio.  minlen and ipshift are decent defaults, but one can try
-    // with (4, 4) or (3, 4) or (4, 3)
-    float cratio = get_cratio(input, input_len, 3, 3);
+    pthread_once(&dispatch_once, init_dispatch);
+    float cratio = get_cratio(input, input_len, B2EP_META_HASH_LOG2(meta),
+                              B2EP_META_MINLEN(meta), B2EP_META_IPSHIFT(meta));
     int cbytes = (int)((float)input_len / cratio);
     if (cbytes > input_len) {
         cbytes = input_len;
@@ -222,3 +415,257 @@ void b2ep_register_codec(blosc2_codec *codec)
     codec->decoder = NULL;
     blosc2_register_codec(codec);
 }
+
+struct b2ep_prober_s {
+    get_csize_fn get_csize;
+    int hash_log2;
+    int minlen;
+    int ipshift;
+    int nwindows;
+    int32_t budget;
+    int nthreads;
+    // Persistent pool of nthreads - 1 workers, the caller is the remaining one
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    unsigned generation;
+    int nbusy;
+    bool end;
+    // The job being probed
+    const uint8_t *src;
+    int32_t srcsize;
+    int32_t blocksize;
+    int32_t nblocks;
+    int block_nwindows;
+    blosc2_instr *instr;
+    atomic_int next_block;
+};
+
+// Mimic what blosc2 reports for an instrumented ENTROPY_PROBE_ID block.
+// Only nwindows windows of the hash length, evenly strided along the block, are probed.
+static void probe_block(b2ep_prober *prober, const uint8_t *block, int32_t bsize, int nwindows,
+                        blosc2_instr *instr)
+{
+    const int32_t window_size = 1 << prober->hash_log2;
+    int32_t stride = 0;
+    int32_t max_nwindows = (bsize + window_size - 1) / window_size;
+    if (nwindows > max_nwindows) {
+        nwindows = max_nwindows;
+    }
+    if (nwindows > 1) {
+        stride = (bsize - window_size) / (nwindows - 1);
+    }
+
+    blosc_timestamp_t last, current;
+    blosc_set_timestamp(&last);
+    int32_t ic = 0, oc = 0, probed = 0;
+    for (int i = 0; i < nwindows; i++) {
+        int32_t offset = i * stride;
+        int32_t wsize = (bsize - offset < window_size) ? bsize - offset : window_size;
+        int32_t wic, woc;
+        prober->get_csize(block + offset, wsize, prober->minlen, prober->ipshift, &wic, &woc);
+        ic += wic;
+        oc += woc;
+        probed += wsize;
+    }
+    blosc_set_timestamp(&current);
+    double ctime = blosc_elapsed_secs(last, current);
+    float cratio = (float)ic / (float)oc;
+
+    int32_t cbytes = (cratio > 0) ? (int32_t)((float)bsize / cratio) : bsize;
+    if (cbytes <= 0 || cbytes > bsize) {
+        // Not compressible, blosc2 would store it as a memcpy
+        cbytes = bsize;
+    }
+    memset(instr, 0, sizeof(blosc2_instr));
+    // cratio is computed having into account 1 additional int (csize)
+    instr->cratio = (float)bsize / (float)(cbytes + (int32_t)sizeof(int32_t));
+    // Scale cspeed as if only the first window had been probed, like the codec does,
+    // so that the features keep the range that the models have been trained with
+    int32_t reference = (bsize < window_size) ? bsize : window_size;
+    double scale = (probed > 0) ? (double)probed / (double)reference : 1.;
+    instr->cspeed = (float)((double)bsize / (ctime > 0 ? ctime : 1e-9) * scale);
+}
+
+// Grab blocks until there are none left.  Every block has its own slot in
+// instr, so no locking is needed for gathering the results.
+static void probe_blocks(b2ep_prober *prober)
+{
+    int32_t blocksize = prober->blocksize;
+    int32_t nblock;
+    while ((nblock = atomic_fetch_add(&prober->next_block, 1)) < prober->nblocks) {
+        int32_t offset = nblock * blocksize;
+        int32_t bsize = (prober->srcsize - offset < blocksize) ? prober->srcsize - offset : blocksize;
+        probe_block(prober, prober->src + offset, bsize, prober->block_nwindows,
+                    &prober->instr[nblock]);
+    }
+}
+
+static void *worker(void *arg)
+{
+    b2ep_prober *prober = arg;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&prober->mutex);
+    while (true) {
+        while (prober->generation == generation && !prober->end) {
+            pthread_cond_wait(&prober->start_cond, &prober->mutex);
+        }
+        if (prober->end) {
+            break;
+        }
+        generation = prober->generation;
+        pthread_mutex_unlock(&prober->mutex);
+
+        probe_blocks(prober);
+
+        pthread_mutex_lock(&prober->mutex);
+        prober->nbusy--;
+        if (prober->nbusy == 0) {
+            pthread_cond_signal(&prober->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&prober->mutex);
+
+    return NULL;
+}
+
+b2ep_prober *b2ep_new_prober(int nthreads)
+{
+    pthread_once(&dispatch_once, init_dispatch);
+    b2ep_prober *prober = calloc(1, sizeof(b2ep_prober));
+    if (prober == NULL) {
+        return NULL;
+    }
+    b2ep_set_params(prober, DEFAULT_HASH_LOG2, DEFAULT_MINLEN, DEFAULT_IPSHIFT);
+    prober->nwindows = 1;
+    prober->budget = 0;
+    prober->nthreads = 1;
+    if (nthreads <= 1) {
+        return prober;
+    }
+
+    prober->threads = malloc((nthreads - 1) * sizeof(pthread_t));
+    if (prober->threads == NULL) {
+        return prober;
+    }
+    pthread_mutex_init(&prober->mutex, NULL);
+    pthread_cond_init(&prober->start_cond, NULL);
+    pthread_cond_init(&prober->done_cond, NULL);
+    for (int i = 0; i < nthreads - 1; i++) {
+        if (pthread_create(&prober->threads[i], NULL, worker, prober) != 0) {
+            break;
+        }
+        prober->nthreads++;
+    }
+
+    return prober;
+}
+
+void b2ep_free_prober(b2ep_prober *prober)
+{
+    if (prober == NULL) {
+        return;
+    }
+    if (prober->threads != NULL) {
+        pthread_mutex_lock(&prober->mutex);
+        prober->end = true;
+        pthread_cond_broadcast(&prober->start_cond);
+        pthread_mutex_unlock(&prober->mutex);
+        for (int i = 0; i < prober->nthreads - 1; i++) {
+            pthread_join(prober->threads[i], NULL);
+        }
+        pthread_mutex_destroy(&prober->mutex);
+        pthread_cond_destroy(&prober->start_cond);
+        pthread_cond_destroy(&prober->done_cond);
+        free(prober->threads);
+    }
+    free(prober);
+}
+
+int b2ep_set_params(b2ep_prober *prober, int hash_log2, int minlen, int ipshift)
+{
+    if (hash_log2 == 0) {
+        hash_log2 = DEFAULT_HASH_LOG2;
+    }
+    if (minlen == 0) {
+        minlen = DEFAULT_MINLEN;
+    }
+    if (ipshift == 0) {
+        ipshift = DEFAULT_IPSHIFT;
+    }
+    if (hash_log2 < B2EP_MIN_HASH_LOG2 || hash_log2 > B2EP_MAX_HASH_LOG2 ||
+        minlen < 0 || ipshift < 0) {
+        return -1;
+    }
+    prober->get_csize = get_csize_kernels[hash_log2 - B2EP_MIN_HASH_LOG2];
+    prober->hash_log2 = hash_log2;
+    prober->minlen = minlen;
+    prober->ipshift = ipshift;
+    return 0;
+}
+
+void b2ep_set_sampling(b2ep_prober *prober, int nwindows, int32_t budget)
+{
+    prober->nwindows = (nwindows > 0) ? nwindows : 1;
+    prober->budget = (budget > 0) ? budget : 0;
+}
+
+int32_t b2ep_nblocks(int32_t srcsize, int32_t blocksize)
+{
+    if (blocksize <= 0) {
+        blocksize = B2EP_DEFAULT_BLOCKSIZE;
+    }
+    return (srcsize + blocksize - 1) / blocksize;
+}
+
+int b2ep_probe(b2ep_prober *prober, const uint8_t *src, int32_t srcsize, int32_t blocksize,
+               blosc2_instr *instr, int32_t ninstr)
+{
+    if (prober == NULL || src == NULL || srcsize < 0) {
+        return -1;
+    }
+    if (blocksize <= 0) {
+        blocksize = B2EP_DEFAULT_BLOCKSIZE;
+    }
+    int32_t nblocks = b2ep_nblocks(srcsize, blocksize);
+    if (nblocks > ninstr) {
+        return -1;
+    }
+
+    prober->src = src;
+    prober->srcsize = srcsize;
+    prober->blocksize = blocksize;
+    prober->nblocks = nblocks;
+    prober->instr = instr;
+    prober->block_nwindows = prober->nwindows;
+    if (prober->budget > 0 && nblocks > 0) {
+        // Spread the chunk budget evenly among the blocks, but probe at least a window each
+        int32_t block_budget = prober->budget / nblocks;
+        int32_t window_size = 1 << prober->hash_log2;
+        prober->block_nwindows = (block_budget > window_size) ? block_budget / window_size : 1;
+    }
+    atomic_store(&prober->next_block, 0);
+    if (prober->nthreads == 1 || nblocks < 2) {
+        probe_blocks(prober);
+        return nblocks;
+    }
+
+    // Wake up the workers and lend them a hand
+    pthread_mutex_lock(&prober->mutex);
+    prober->nbusy = prober->nthreads - 1;
+    prober->generation++;
+    pthread_cond_broadcast(&prober->start_cond);
+    pthread_mutex_unlock(&prober->mutex);
+
+    probe_blocks(prober);
+
+    pthread_mutex_lock(&prober->mutex);
+    while (prober->nbusy > 0) {
+        pthread_cond_wait(&prober->done_cond, &prober->mutex);
+    }
+    pthread_mutex_unlock(&prober->mutex);
+
+    return nblocks;
+}
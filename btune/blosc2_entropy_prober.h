@@ -10,6 +10,50 @@ extern "C" {
 #define ENTROPY_PROBE_ID 244
 void b2ep_register_codec(blosc2_codec *codec);
 #define FILTER_STOP 3
+
+// Range of the hash sizes (log2) supported by the entropy prober
+#define B2EP_MIN_HASH_LOG2 12
+#define B2EP_MAX_HASH_LOG2 15
+
+// The ENTROPY_PROBE_ID codec meta selects the prober parameters: the lowest 2 bits are
+// hash_log2 - 12, the next 2 bits minlen - 3 and the next 2 bits ipshift - 3.
+// So a meta of 0 means the defaults: a hash_log2 of 12, a minlen of 3 and an ipshift of 3.
+#define B2EP_META(hash_log2, minlen, ipshift) \
+    (uint8_t)((((hash_log2) - 12) & 3) | ((((minlen) - 3) & 3) << 2) | ((((ipshift) - 3) & 3) << 4))
+#define B2EP_META_HASH_LOG2(meta) (12 + ((meta) & 3))
+#define B2EP_META_MINLEN(meta) (3 + (((meta) >> 2) & 3))
+#define B2EP_META_IPSHIFT(meta) (3 + (((meta) >> 4) & 3))
+
+// Blocksize used by b2ep_probe() when none is given
+#define B2EP_DEFAULT_BLOCKSIZE (32 * 1024)
+
+// Entropy prober context, meant to be reused across chunks.  With nthreads > 1
+// it keeps a pool of threads and the blocks of a chunk are probed in parallel.
+typedef struct b2ep_prober_s b2ep_prober;
+
+b2ep_prober *b2ep_new_prober(int nthreads);
+void b2ep_free_prober(b2ep_prober *prober);
+
+// Set the hash size (log2, between B2EP_MIN_HASH_LOG2 and B2EP_MAX_HASH_LOG2), the minimum
+// length of a match, and the shift applied at the end of a match.  Larger hashes give more
+// accurate estimates for larger windows, at a higher cost.  A value of 0 selects the default.
+// Returns 0 on success, or a negative value if the parameters are out of range.
+int b2ep_set_params(b2ep_prober *prober, int hash_log2, int minlen, int ipshift);
+
+// Probe nwindows windows per block, evenly strided along it (1 by default, which only
+// looks at the start of every block).  If budget > 0, the number of windows per block is
+// instead derived from a budget of bytes to probe per chunk.
+void b2ep_set_sampling(b2ep_prober *prober, int nwindows, int32_t budget);
+
+// Number of blocks (and hence blosc2_instr records) b2ep_probe() emits for a buffer
+int32_t b2ep_nblocks(int32_t srcsize, int32_t blocksize);
+
+// Probe every block of src, writing its cratio/cspeed into instr, which must have room
+// for b2ep_nblocks(srcsize, blocksize) records.  This computes the same features as
+// compressing with ENTROPY_PROBE_ID and instr_codec, without any (de)compression round-trip.
+// Returns the number of blocks probed, or a negative value on error.
+int b2ep_probe(b2ep_prober *prober, const uint8_t *src, int32_t srcsize, int32_t blocksize,
+               blosc2_instr *instr, int32_t ninstr);
 #ifdef __cplusplus
 }
 #endif
@@ -7,42 +7,52 @@
   See COPYING.txt for details about copyright and rights to use.
 ***********************************************************************/
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif !defined(_WIN32)
+#include <unistd.h>
+#endif
 
 #include "blosc2/filters-registry.h"
 #include "btune.h"
+#include "btune_cache.h"
 #include "btune_model.h"
+#include "btune_shuffle.h"
 
 
-// Disable shufflesize and blocksize
-#define BTUNE_DISABLE_SHUFFLESIZE  true
-#define BTUNE_DISABLE_BLOCKSIZE    true
+// Disable memcpy
 #define BTUNE_DISABLE_MEMCPY       true
-#define BTUNE_DISABLE_THREADS      true
 
 
 // Internal btune control behaviour constants.
 enum {
   BTUNE_KB = 1024,
   MAX_CLEVEL = 9,
-  MIN_BLOCK = 16 * BTUNE_KB,  // TODO remove when included in blosc.h
-  MAX_BLOCK = 2 * BTUNE_KB * BTUNE_KB,
+  MIN_CACHE = 8 * BTUNE_KB,
+  MAX_CACHE = 64 * BTUNE_KB * BTUNE_KB,
   MIN_BITSHUFFLE = 1,
   MIN_SHUFFLE = 2,
   MAX_SHUFFLE = 16,
   MIN_THREADS = 1,
   SOFT_STEP_SIZE = 1,
   HARD_STEP_SIZE = 2,
-  MAX_STATE_THREADS = 50,  // 50 magic number big enough to not tune threads this number of times
 };
 
 static const cparams_btune cparams_btune_default = {
   .compcode = BLOSC_LZ4,
   .filter = BLOSC_SHUFFLE,
+  .prefilter = 0,
+  .prefilter_meta = 0,
   .splitmode = BLOSC_ALWAYS_SPLIT,
   .clevel = 9,
   .blocksize = 0,
@@ -59,32 +69,118 @@ static const cparams_btune cparams_btune_default = {
   .dtime = 100
 };
 
+// The state shared by the members of a tuning group
+struct btune_group_s {
+  pthread_mutex_t mutex;
+  // Protects best
+  atomic_uint_fast64_t version;
+  // Incremented every time best changes (0 while there is no best)
+  cparams_btune best;
+  // The best cparams published by the members
+};
+
+// The capabilities of a codec that matter for tuning it
+typedef struct {
+  int compcode;
+  // The codec
+  bool hcr;
+  // Whether the codec is meant for high compression ratios (and larger blocks)
+  bool hcr_bitshuffle;
+  // Whether the codec is meant for high compression ratios with BITSHUFFLE
+  bool slow;
+  // Whether the codec is slow in high clevels (limited in BALANCED mode, starting at 3)
+  int max_clevel;
+  // The maximum clevel worth trying
+} codec_caps;
+
+/* Includes LZ4 + BITSHUFFLE as HCR, but not BloscLZ + BITSHUFFLE because,
+   for some reason, the latter does not work too well */
+static const codec_caps codecs_caps[] = {
+  {BLOSC_BLOSCLZ, false, false, false, MAX_CLEVEL},
+  {BLOSC_LZ4, false, true, false, MAX_CLEVEL},
+  {BLOSC_LZ4HC, true, true, false, MAX_CLEVEL},
+  {BLOSC_ZLIB, true, true, true, MAX_CLEVEL},
+  // ZSTD level 9 is extremely slow, so avoid it, always
+  {BLOSC_ZSTD, true, true, true, MAX_CLEVEL - 1},
+};
+
+// The unknown (e.g. plugin) codecs are tuned as fast ones
+static const codec_caps default_caps = {-1, false, false, false, MAX_CLEVEL};
+
+static const codec_caps *get_codec_caps(int compcode) {
+  for (size_t i = 0; i < sizeof(codecs_caps) / sizeof(codecs_caps[0]); i++) {
+    if (codecs_caps[i].compcode == compcode) {
+      return &codecs_caps[i];
+    }
+  }
+  return &default_caps;
+}
+
 static void add_codec(btune_struct *btune_params, int compcode) {
   for (int i = 0; i < btune_params->ncodecs; i++) {
     if (btune_params->codecs[i] == compcode) {
       return;
     }
   }
-  assert(btune_params->ncodecs < BTUNE_MAX_CODECS);
+  if (btune_params->ncodecs >= BTUNE_MAX_CODECS) {
+    fprintf(stderr, "WARNING: too many codecs, ignoring codec %d\n", compcode);
+    return;
+  }
   btune_params->codecs[btune_params->ncodecs] = compcode;
   btune_params->ncodecs++;
 }
 
-static void add_filter(btune_struct *btune_params, uint8_t filter) {
+// Add a filter pipeline, a prefilter (0 for none) followed by the filter
+static void add_filter(btune_struct *btune_params, uint8_t prefilter, uint8_t filter) {
   for (int i = 0; i < btune_params->nfilters; i++) {
-    if (btune_params->filters[i] == filter) {
+    if ((btune_params->filters[i] == filter) && (btune_params->prefilters[i] == prefilter)) {
       return;
     }
   }
-  assert(btune_params->nfilters < BTUNE_MAX_FILTERS);
+  if (btune_params->nfilters >= BTUNE_MAX_FILTERS) {
+    fprintf(stderr, "WARNING: too many filters, ignoring filter %d (prefilter %d)\n", filter, prefilter);
+    return;
+  }
   btune_params->filters[btune_params->nfilters] = filter;
+  btune_params->prefilters[btune_params->nfilters] = prefilter;
   btune_params->nfilters++;
 }
 
+// Whether the codec and filter are in the allowlists of the config (if any)
+static bool is_allowed(btune_struct *btune_params, int compcode, uint8_t filter) {
+  btune_config *config = &btune_params->config;
+  bool codec_allowed = (config->ncodecs <= 0);
+  for (int i = 0; (i < config->ncodecs) && (i < BTUNE_MAX_CODECS); i++) {
+    codec_allowed = codec_allowed || (config->codecs[i] == compcode);
+  }
+  bool filter_allowed = (config->nfilters <= 0);
+  for (int i = 0; (i < config->nfilters) && (i < BTUNE_MAX_FILTERS); i++) {
+    filter_allowed = filter_allowed || (config->filters[i] == filter);
+  }
+  return codec_allowed && filter_allowed;
+}
+
 // Get the codecs list for btune
 static void btune_init_codecs(btune_struct *btune_params) {
+  btune_config *config = &btune_params->config;
+  if (config->ncodecs > 0) {
+    // Only the ones asked for that are available (or registered)
+    for (int i = 0; (i < config->ncodecs) && (i < BTUNE_MAX_CODECS); i++) {
+      const char *compname;
+      if (blosc2_compcode_to_compname(config->codecs[i], &compname) < 0) {
+        fprintf(stderr, "WARNING: codec %d is not available, ignoring it\n", config->codecs[i]);
+        continue;
+      }
+      add_codec(btune_params, config->codecs[i]);
+    }
+    if (btune_params->ncodecs > 0) {
+      return;
+    }
+    fprintf(stderr, "WARNING: none of the codecs is available, using the defaults\n");
+  }
+
   const char * all_codecs = blosc2_list_compressors();
-  if (btune_params->config.comp_mode == BTUNE_COMP_HCR) {
+  if (config->comp_mode == BTUNE_COMP_HCR) {
     // In HCR mode only try with ZSTD and ZLIB
     if (strstr(all_codecs, "zstd") != NULL) {
       add_codec(btune_params, BLOSC_ZSTD);
@@ -97,20 +193,70 @@ static void btune_init_codecs(btune_struct *btune_params) {
   } else {
     // In all other modes, LZ4 is mandatory
     add_codec(btune_params, BLOSC_LZ4);
-    if (btune_params->config.comp_mode == BTUNE_COMP_BALANCED) {
+    if (config->comp_mode == BTUNE_COMP_BALANCED) {
       // In BALANCE mode give BLOSCLZ a chance
       add_codec(btune_params, BLOSC_BLOSCLZ);
     }
-    if (btune_params->config.perf_mode == BTUNE_PERF_DECOMP) {
+    if (config->perf_mode == BTUNE_PERF_DECOMP) {
       add_codec(btune_params, BLOSC_LZ4HC);
     }
   }
 }
 
+// Get the filters list for btune
+static void btune_init_filters(btune_struct *btune_params, int32_t typesize) {
+  btune_config *config = &btune_params->config;
+  if (config->nfilters > 0) {
+    for (int i = 0; (i < config->nfilters) && (i < BTUNE_MAX_FILTERS); i++) {
+      add_filter(btune_params, 0, config->filters[i]);
+    }
+  } else {
+    add_filter(btune_params, 0, BLOSC_NOFILTER);
+    add_filter(btune_params, 0, BLOSC_SHUFFLE);
+    add_filter(btune_params, 0, BLOSC_BITSHUFFLE);
+  }
+  bool shuffle = false;
+  bool bitshuffle = false;
+  for (int i = 0; i < btune_params->nfilters; i++) {
+    shuffle = shuffle || (btune_params->filters[i] == BLOSC_SHUFFLE);
+    bitshuffle = bitshuffle || (btune_params->filters[i] == BLOSC_BITSHUFFLE);
+  }
+  if (config->filter_chains) {
+    if (shuffle) {
+      add_filter(btune_params, BLOSC_DELTA, BLOSC_SHUFFLE);
+    }
+    if (bitshuffle) {
+      add_filter(btune_params, BLOSC_DELTA, BLOSC_BITSHUFFLE);
+    }
+  }
+  // The lossy chains only for floating point sizes and when asked for
+  if ((config->trunc_prec_bits != 0) && ((typesize == 4) || (typesize == 8))) {
+    if (shuffle) {
+      add_filter(btune_params, BLOSC_TRUNC_PREC, BLOSC_SHUFFLE);
+    }
+    if (bitshuffle) {
+      add_filter(btune_params, BLOSC_TRUNC_PREC, BLOSC_BITSHUFFLE);
+    }
+  }
+}
+
+// The filters meta of a prefilter
+static uint8_t get_prefilter_meta(btune_struct *btune_params, uint8_t prefilter) {
+  if (prefilter == BLOSC_TRUNC_PREC) {
+    return (uint8_t) btune_params->config.trunc_prec_bits;
+  }
+  return 0;
+}
+
 // Extract the cparams_btune inside blosc2_context
 static void extract_btune_cparams(blosc2_context *context, cparams_btune *cparams){
   cparams->compcode = context->compcode;
   cparams->filter = context->filters[BLOSC2_MAX_FILTERS - 1];
+  // BYTEDELTA uses the previous slot for its SHUFFLE
+  if (cparams->filter != BLOSC_FILTER_BYTEDELTA) {
+    cparams->prefilter = context->filters[BLOSC2_MAX_FILTERS - 2];
+    cparams->prefilter_meta = context->filters_meta[BLOSC2_MAX_FILTERS - 2];
+  }
   cparams->clevel = context->clevel;
   cparams->splitmode = context->splitmode;
   cparams->blocksize = context->blocksize;
@@ -157,10 +303,10 @@ static bool has_ended_blocksize(blosc2_context *ctx){
   btune_struct *btune_params = (btune_struct*) ctx->btune_params;
   cparams_btune *best = btune_params->best;
   return ((best->increasing_block &&
-           ((best->blocksize > (MAX_BLOCK >> btune_params->step_size)) ||
+           ((best->blocksize > (btune_params->max_blocksize >> btune_params->step_size)) ||
             (best->blocksize > (ctx->sourcesize >> btune_params->step_size)))) ||
           (!best->increasing_block &&
-           (best->blocksize < (MIN_BLOCK << btune_params->step_size))));
+           (best->blocksize < (btune_params->min_blocksize << btune_params->step_size))));
 }
 
 // Init a soft readapt
@@ -168,26 +314,61 @@ static void init_soft(btune_struct *btune_params) {
   if (has_ended_clevel(btune_params)) {
     btune_params->best->increasing_clevel = !btune_params->best->increasing_clevel;
   }
-  btune_params->state = CLEVEL;
+  btune_params->state = (btune_params->config.search_mode == BTUNE_SEARCH_BANDIT) ? BANDIT : CLEVEL;
   btune_params->step_size = SOFT_STEP_SIZE;
   btune_params->readapt_from = SOFT;
+  btune_params->readapt_improved = false;
+}
+
+// Use the inferred codecs and filters as the only candidates of the CODEC_FILTER state
+static void apply_inference(btune_struct *btune_params) {
+  if (btune_params->ninferred == 0) {
+    return;
+  }
+  for (int i = 0; i < btune_params->ninferred; i++) {
+    btune_params->candidate_codecs[i] = btune_params->inferred_codecs[i];
+    btune_params->candidate_filters[i] = btune_params->inferred_filters[i];
+    btune_params->candidate_prefilters[i] = btune_params->inferred_prefilters[i];
+  }
+  btune_params->ncandidates = btune_params->ninferred;
+  btune_params->ninferred = 0;
+}
+
+// Number of combinations of codec, filter and split tried in the CODEC_FILTER state
+static int codec_filter_ncombinations(btune_struct *btune_params) {
+  if (btune_params->ncandidates > 0) {
+    return btune_params->ncandidates * 2;
+  }
+  return btune_params->ncodecs * btune_params->nfilters * 2;
 }
 
 // Init a hard readapt
 static void init_hard(btune_struct *btune_params) {
-  btune_params->state = CODEC_FILTER;
+  apply_inference(btune_params);
+  btune_params->state = (btune_params->config.search_mode == BTUNE_SEARCH_BANDIT) ? BANDIT : CODEC_FILTER;
   btune_params->step_size = HARD_STEP_SIZE;
   btune_params->readapt_from = HARD;
+  btune_params->readapt_improved = false;
   if (btune_params->config.perf_mode == BTUNE_PERF_DECOMP) {
     btune_params->threads_for_comp = false;
   } else {
     btune_params->threads_for_comp = true;
   }
+  btune_params->threads_second_phase = false;
   if (has_ended_shuffle(btune_params->best)) {
     btune_params->best->increasing_shuffle = !btune_params->best->increasing_shuffle;
   }
 }
 
+// Init the step size of the first readapt
+static void init_step_size(btune_struct *btune_params) {
+  if (btune_params->config.behaviour.nhards_before_stop == 1) {
+    btune_params->step_size = SOFT_STEP_SIZE;
+  } else {
+    btune_params->step_size = HARD_STEP_SIZE;
+  }
+}
+
 // Init when the number of hard is 0
 static void init_without_hards(blosc2_context *ctx) {
   btune_struct *btune_params = (btune_struct*) ctx->btune_params;
@@ -237,6 +418,8 @@ static const char* stcode_to_stname(btune_struct *btune_params) {
       return "CLEVEL";
     case BLOCKSIZE:
       return "BLOCKSIZE";
+    case BANDIT:
+      return "BANDIT";
     case MEMCPY:
       return "MEMCPY";
     case WAITING:
@@ -269,6 +452,8 @@ static const char* perf_mode_to_str(btune_performance_mode perf_mode) {
       return "BALANCED";
     case BTUNE_PERF_COMP:
       return "COMP";
+    case BTUNE_PERF_DEADLINE:
+      return "DEADLINE";
     default:
       return "UNKNOWN";
   }
@@ -287,16 +472,15 @@ static const char* comp_mode_to_str(btune_comp_mode comp_mode) {
   }
 }
 
-static void bandwidth_to_str(char * str, uint32_t bandwidth) {
-  if (bandwidth < BTUNE_MBPS) {
-    sprintf(str, "%d KB/s", bandwidth);
-  } else if (bandwidth < BTUNE_GBPS) {
-    sprintf(str, "%d MB/s", bandwidth / BTUNE_KB);
-  } else if (bandwidth < BTUNE_TBPS) {
-    sprintf(str, "%d GB/s", bandwidth / BTUNE_KB / BTUNE_KB);
-  } else {
-    sprintf(str, "%d TB/s", bandwidth / BTUNE_KB / BTUNE_KB / BTUNE_KB);
+static void bandwidth_to_str(char * str, size_t size, uint64_t bandwidth) {
+  const char *units[] = {"B/s", "KB/s", "MB/s", "GB/s", "TB/s", "PB/s", "EB/s"};
+  double value = (double) bandwidth;
+  int unit = 0;
+  while ((value >= BTUNE_KB) && (unit < (int) (sizeof(units) / sizeof(units[0])) - 1)) {
+    value /= BTUNE_KB;
+    unit++;
   }
+  snprintf(str, size, "%.4g %s", value, units[unit]);
 }
 
 static const char* repeat_mode_to_str(btune_repeat_mode repeat_mode) {
@@ -320,6 +504,154 @@ static const char* repeat_mode_to_str(btune_repeat_mode repeat_mode) {
 
 
 
+// The cache sizes of the CPU, detected only once per process
+static int32_t l1_size = L1;
+static int32_t l2_size = L2;
+static pthread_once_t cache_sizes_once = PTHREAD_ONCE_INIT;
+
+#if !defined(__APPLE__) && !defined(_WIN32)
+// Read the size of the data or unified cache of the given level of the first CPU from sysfs
+static int32_t read_sysfs_cache_size(int level) {
+  char path[128];
+  char buf[32];
+  for (int index = 0; index < 8; index++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+      break;
+    }
+    int cache_level = 0;
+    int nread = fscanf(file, "%d", &cache_level);
+    fclose(file);
+    if ((nread != 1) || (cache_level != level)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+    file = fopen(path, "r");
+    if (file == NULL) {
+      continue;
+    }
+    nread = fscanf(file, "%31s", buf);
+    fclose(file);
+    if ((nread != 1) || (strcmp(buf, "Instruction") == 0)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+    file = fopen(path, "r");
+    if (file == NULL) {
+      continue;
+    }
+    int size = 0;
+    char unit = 0;
+    nread = fscanf(file, "%d%c", &size, &unit);
+    fclose(file);
+    if (nread < 1) {
+      continue;
+    }
+    if (unit == 'K') {
+      size *= BTUNE_KB;
+    } else if (unit == 'M') {
+      size *= BTUNE_KB * BTUNE_KB;
+    }
+    return size;
+  }
+  return 0;
+}
+#endif
+
+// Detect the L1 (data) and L2 cache sizes, falling back to the L1 and L2 macros
+static void detect_cache_sizes(void) {
+  int64_t l1 = 0;
+  int64_t l2 = 0;
+#if defined(__APPLE__)
+  int64_t value = 0;
+  size_t len = sizeof(value);
+  if (sysctlbyname("hw.l1dcachesize", &value, &len, NULL, 0) == 0) {
+    l1 = value;
+  }
+  len = sizeof(value);
+  if (sysctlbyname("hw.l2cachesize", &value, &len, NULL, 0) == 0) {
+    l2 = value;
+  }
+#elif !defined(_WIN32)
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+  l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+  l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  // sysconf returns 0 or -1 on some architectures (e.g. ARM), so try sysfs then
+  if (l1 <= 0) {
+    l1 = read_sysfs_cache_size(1);
+  }
+  if (l2 <= 0) {
+    l2 = read_sysfs_cache_size(2);
+  }
+#endif
+  if ((l1 >= MIN_CACHE) && (l1 <= MAX_CACHE)) {
+    l1_size = (int32_t) l1;
+  }
+  if ((l2 > l1_size) && (l2 <= MAX_CACHE)) {
+    l2_size = (int32_t) l2;
+  }
+}
+
+void btune_log(btune_struct * btune, const char * format, ...) {
+  if (btune->log_buffer == NULL) {
+    return;
+  }
+  for (int attempt = 0; attempt < 2; attempt++) {
+    size_t room = BTUNE_LOG_BUFFER_SIZE - btune->log_len;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(btune->log_buffer + btune->log_len, room, format, args);
+    va_end(args);
+    if (len < 0) {
+      return;
+    }
+    if ((size_t) len < room) {
+      btune->log_len += len;
+      return;
+    }
+    // A message larger than the whole buffer is truncated
+    if (btune->log_len == 0) {
+      btune->log_len = BTUNE_LOG_BUFFER_SIZE - 1;
+      btune_flush_log(btune);
+      return;
+    }
+    btune_flush_log(btune);
+  }
+}
+
+void btune_flush_log(btune_struct * btune) {
+  if (btune->log_len == 0) {
+    return;
+  }
+  if (btune->config.log_callback != NULL) {
+    btune->config.log_callback(btune->log_buffer, btune->log_len, btune->config.log_user_data);
+  } else {
+    fwrite(btune->log_buffer, 1, btune->log_len, stdout);
+    fflush(stdout);
+  }
+  btune->log_len = 0;
+}
+
+// Init starting from the cparams in best (given by the user or the tuning cache)
+static void init_with_hint(blosc2_context *ctx) {
+  btune_struct *btune = (btune_struct*) ctx->btune_params;
+  add_codec(btune, btune->best->compcode);
+  if (btune->config.behaviour.nhards_before_stop > 0) {
+    if (btune->config.behaviour.nsofts_before_hard > 0){
+      init_soft(btune);
+    } else if (btune->config.behaviour.nwaits_before_readapt > 0) {
+      btune->state = WAITING;
+      btune->readapt_from = WAIT;
+    } else {
+      init_hard(btune);
+    }
+  } else {
+    init_without_hards(ctx);
+  }
+}
+
 // Init btune_struct inside blosc2_context
 void btune_init(void *btune_params, blosc2_context * cctx, blosc2_context * dctx) {
   btune_config *config = (btune_config *)btune_params;
@@ -332,17 +664,31 @@ void btune_init(void *btune_params, blosc2_context * cctx, blosc2_context * dctx
     memcpy(&btune->config, config, sizeof(btune_config));
   }
 
-  char* envvar = getenv("BTUNE_LOG");
-  if (envvar != NULL) {
-    printf("-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n");
-    char bandwidth_str[12];
-    bandwidth_to_str(bandwidth_str, btune->config.bandwidth);
-    printf("BTune version: %s.\n"
-           "Perfomance Mode: %s, Compression Mode: %s, Bandwidth: %s.\n"
+  btune->bandwidth = (double) btune->config.bandwidth;
+  btune->read_bandwidth = (btune->config.read_bandwidth > 0) ? (double) btune->config.read_bandwidth : btune->bandwidth;
+  btune->scored_bandwidth = btune->bandwidth;
+  btune->scored_read_bandwidth = btune->read_bandwidth;
+  btune->readapt_bandwidth = btune->bandwidth;
+  btune->readapt_read_bandwidth = btune->read_bandwidth;
+
+  // The logging configuration is resolved only once
+  btune->log = getenv("BTUNE_LOG") != NULL;
+  btune->debug = getenv("BTUNE_DEBUG") != NULL;
+  if (btune->log || btune->debug) {
+    btune->log_buffer = malloc(BTUNE_LOG_BUFFER_SIZE);
+  }
+  if (btune->log) {
+    btune_log(btune, "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n");
+    char bandwidth_str[32];
+    char read_bandwidth_str[32];
+    bandwidth_to_str(bandwidth_str, sizeof(bandwidth_str), (uint64_t) btune->bandwidth);
+    bandwidth_to_str(read_bandwidth_str, sizeof(read_bandwidth_str), (uint64_t) btune->read_bandwidth);
+    btune_log(btune, "BTune version: %s.\n"
+           "Perfomance Mode: %s, Compression Mode: %s, Bandwidth: %s (read %s).\n"
            "Behaviour: Waits - %d, Softs - %d, Hards - %d, Repeat Mode - %s.\n",
            BTUNE_VERSION_STRING, perf_mode_to_str(btune->config.perf_mode),
            comp_mode_to_str(btune->config.comp_mode),
-           bandwidth_str,
+           bandwidth_str, read_bandwidth_str,
            btune->config.behaviour.nwaits_before_readapt,
            btune->config.behaviour.nsofts_before_hard,
            btune->config.behaviour.nhards_before_stop,
@@ -350,12 +696,22 @@ void btune_init(void *btune_params, blosc2_context * cctx, blosc2_context * dctx
   }
 
   btune->dctx = dctx;
+  int nthreads_probe = btune->config.nthreads_probe;
+  if (nthreads_probe <= 0) {
+    nthreads_probe = cctx->nthreads;
+  }
+  btune->prober = b2ep_new_prober(nthreads_probe);
+  if (btune->prober != NULL) {
+    if (b2ep_set_params(btune->prober, btune->config.probe_hash_log2,
+                        btune->config.probe_minlen, btune->config.probe_ipshift) < 0) {
+      fprintf(stderr, "WARNING: invalid entropy probe parameters, using the defaults\n");
+    }
+    b2ep_set_sampling(btune->prober, btune->config.probe_nwindows, btune->config.probe_budget);
+  }
 
   // Initlialize codescs and filters
   btune_init_codecs(btune);
-  add_filter(btune, BLOSC_NOFILTER);
-  add_filter(btune, BLOSC_SHUFFLE);
-  add_filter(btune, BLOSC_BITSHUFFLE);
+  btune_init_filters(btune, cctx->typesize);
 
   // State attributes
   btune->rep_index = 0;
@@ -380,8 +736,8 @@ void btune_init(void *btune_params, blosc2_context * cctx, blosc2_context * dctx
     best->clevel = 8;
     aux->clevel = 8;
   }
-  best->shufflesize = cctx->typesize;  // TODO typesize -> shufflesize
-  aux->shufflesize = cctx->typesize;  // TODO typesize -> shufflesize
+  best->shufflesize = cctx->typesize;  // Until detected or tuned
+  aux->shufflesize = cctx->typesize;
   best->nthreads_comp = cctx->nthreads;
   aux->nthreads_comp = cctx->nthreads;
   if (dctx != NULL){
@@ -395,10 +751,32 @@ void btune_init(void *btune_params, blosc2_context * cctx, blosc2_context * dctx
     aux->nthreads_decomp = cctx->nthreads;
     btune->nthreads_decomp = cctx->nthreads;
   }
+  if (btune->config.max_threads > 0) {
+    btune->max_threads = btune->config.max_threads;
+  }
+
+  // Cache sizes and bounds for the blocksize tuning
+  pthread_once(&cache_sizes_once, detect_cache_sizes);
+  btune->l1_size = l1_size;
+  btune->l2_size = l2_size;
+  BTUNE_DEBUG(btune, "Cache sizes: L1 %d KB, L2 %d KB", l1_size / BTUNE_KB, l2_size / BTUNE_KB);
+  btune->min_blocksize = l1_size / 2;
+  btune->max_blocksize = 8 * l2_size;
+  // The automatic blocksize plus the powers of two within bounds
+  btune->bandit_nblocksizes = 1;
+  if (btune->config.tune_blocksize) {
+    while ((btune->bandit_nblocksizes < BTUNE_BANDIT_MAX_BLOCKSIZES) &&
+           ((btune->min_blocksize << (btune->bandit_nblocksizes - 1)) <= btune->max_blocksize)) {
+      btune->bandit_nblocksizes++;
+    }
+  }
 
   // Aux arrays to calculate the mean
-  btune->current_cratios = malloc(sizeof(double)) ;
-  btune->current_scores = malloc(sizeof(double));
+  uint32_t nreps = (btune->config.behaviour.nreps > 1) ? btune->config.behaviour.nreps : 1;
+  btune->current_cratios = malloc(nreps * sizeof(double));
+  btune->current_scores = malloc(nreps * sizeof(double));
+  btune->current_ctimes = malloc(nreps * sizeof(double));
+  btune->current_dtimes = malloc(nreps * sizeof(double));
 
   if (btune->config.perf_mode == BTUNE_PERF_DECOMP) {
     btune->threads_for_comp = false;
@@ -406,32 +784,25 @@ void btune_init(void *btune_params, blosc2_context * cctx, blosc2_context * dctx
     btune->threads_for_comp = true;
   }
 
+  // Tuning cache
+  const char *cache_path = btune->config.cache_path;
+  if (cache_path == NULL) {
+    cache_path = getenv("BTUNE_CACHE");
+  }
+  if ((cache_path != NULL) && (cache_path[0] != '\0')) {
+    btune->cache_path = strdup(cache_path);
+  }
+
   // cparams_hint
-  if (config->cparams_hint) {
+  if (btune->config.cparams_hint) {
     extract_btune_cparams(cctx, btune->best);
     extract_btune_cparams(cctx, btune->aux_cparams);
-    add_codec(btune, cctx->compcode);
-    if (btune->config.behaviour.nhards_before_stop > 0) {
-      if (btune->config.behaviour.nsofts_before_hard > 0){
-        init_soft(btune);
-      } else if (btune->config.behaviour.nwaits_before_readapt > 0) {
-        btune->state = WAITING;
-        btune->readapt_from = WAIT;
-      } else {
-        init_hard(btune);
-      }
-    } else {
-      init_without_hards(cctx);
-    }
+    init_with_hint(cctx);
   } else {
     init_hard(btune);
     btune->config.behaviour.nhards_before_stop++;
   }
-  if (btune->config.behaviour.nhards_before_stop == 1) {
-    btune->step_size = SOFT_STEP_SIZE;
-  } else {
-    btune->step_size = HARD_STEP_SIZE;
-  }
+  init_step_size(btune);
 }
 
 // Free btune_struct
@@ -441,37 +812,34 @@ void btune_free(blosc2_context *context) {
   free(btune_params->aux_cparams);
   free(btune_params->current_scores);
   free(btune_params->current_cratios);
+  free(btune_params->current_ctimes);
+  free(btune_params->current_dtimes);
+  b2ep_free_prober(btune_params->prober);
+  free(btune_params->probe_instr);
+  if (btune_params->dtime_dctx != NULL) {
+    blosc2_free_ctx(btune_params->dtime_dctx);
+  }
+  free(btune_params->dtime_buffer);
+  free(btune_params->cache_path);
+  btune_flush_log(btune_params);
+  free(btune_params->log_buffer);
   free(btune_params);
   context->btune_params = NULL;
 }
 
-/* Whether a codec is meant for High Compression Ratios
-   Includes LZ4 + BITSHUFFLE here, but not BloscLZ + BITSHUFFLE because,
-   for some reason, the latter does not work too well */
+// Whether a codec is meant for High Compression Ratios
 static bool is_HCR(blosc2_context *context) {
-  switch (context->compcode) {
-    case BLOSC_BLOSCLZ :
-      return false;
-    case BLOSC_LZ4 :
-      return (context->filter_flags & BLOSC_DOBITSHUFFLE) ? true : false;
-    case BLOSC_LZ4HC :
-      return true;
-    case BLOSC_ZLIB :
-      return true;
-    case BLOSC_ZSTD :
-      return true;
-    default :
-      fprintf(stderr, "Error in is_COMP_HCR: codec %d not handled\n",
-              context->compcode);
+  const codec_caps *caps = get_codec_caps(context->compcode);
+  if (context->filter_flags & BLOSC_DOBITSHUFFLE) {
+    return caps->hcr_bitshuffle;
   }
-  return false;
+  return caps->hcr;
 }
 
 // Set the automatic blocksize 0 to its real value
 void btune_next_blocksize(blosc2_context *context) {
-  if (BTUNE_DISABLE_BLOCKSIZE) {
-    return;
-  }
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  int32_t l1 = (btune_params != NULL) ? btune_params->l1_size : L1;
   int32_t clevel = context->clevel;
   int32_t typesize = context->typesize;
   size_t nbytes = context->sourcesize;
@@ -491,8 +859,8 @@ void btune_next_blocksize(blosc2_context *context) {
       blocksize = BLOSC_MIN_BUFFERSIZE;
     }
   }
-  else if (nbytes >= L1) {
-    blocksize = L1;
+  else if (nbytes >= (size_t) l1) {
+    blocksize = l1;
 
     /* For HCR codecs, increase the block sizes by a factor of 2 because they
         are meant for compressing large blocks (i.e. they show a big overhead
@@ -526,7 +894,7 @@ void btune_next_blocksize(blosc2_context *context) {
         blocksize *= 8;
         break;
       case 9:
-        // Do not exceed 256 KB for non HCR codecs
+        // Do not exceed 8 times the L1 for non HCR codecs
         blocksize *= 8;
         if (is_HCR(context)) {
           blocksize *= 2;
@@ -563,33 +931,53 @@ void btune_next_blocksize(blosc2_context *context) {
   context->blocksize = blocksize;
 }
 
-// Set the cparams_btune inside blosc2_context
-static void set_btune_cparams(blosc2_context * context, cparams_btune * cparams){
-  context->compcode = cparams->compcode;
+// Do not set a too large clevel for the slow codecs
+static void limit_clevel(btune_struct *btune_params, cparams_btune *cparams) {
+  // Do not set a too large clevel for ZSTD and BALANCED mode
+  const codec_caps *caps = get_codec_caps(cparams->compcode);
+  if (btune_params->config.comp_mode == BTUNE_COMP_BALANCED && caps->slow &&
+      cparams->clevel >= 3) {
+    cparams->clevel = 3;
+  }
+  if (cparams->clevel > caps->max_clevel) {
+    cparams->clevel = caps->max_clevel;
+  }
+  // Do not set a too large clevel for HCR mode
+  if (btune_params->config.comp_mode == BTUNE_COMP_HCR && cparams->clevel >= 6) {
+    cparams->clevel = 6;
+  }
+}
 
+// Set the filters of the cparams_btune in the filters pipeline
+static void set_filters(uint8_t *filters, uint8_t *filters_meta, const cparams_btune *cparams,
+                        int32_t typesize) {
   if (cparams->filter == BLOSC_FILTER_BYTEDELTA) {
-    context->filters[BLOSC2_MAX_FILTERS - 2] = BLOSC_SHUFFLE;
-    context->filters[BLOSC2_MAX_FILTERS - 1] = BLOSC_FILTER_BYTEDELTA;
-    context->filters_meta[BLOSC2_MAX_FILTERS - 1] = context->schunk->typesize;
+    filters[BLOSC2_MAX_FILTERS - 2] = BLOSC_SHUFFLE;
+    filters[BLOSC2_MAX_FILTERS - 1] = BLOSC_FILTER_BYTEDELTA;
+    filters_meta[BLOSC2_MAX_FILTERS - 1] = (uint8_t) typesize;
   }
   else {
-    context->filters[BLOSC2_MAX_FILTERS - 2] = 0;
-    context->filters[BLOSC2_MAX_FILTERS - 1] = cparams->filter;
+    // TRUNC_PREC only works with floating point sizes
+    uint8_t prefilter = cparams->prefilter;
+    if ((prefilter == BLOSC_TRUNC_PREC) && (cparams->shufflesize != 4) && (cparams->shufflesize != 8)) {
+      prefilter = 0;
+    }
+    filters[BLOSC2_MAX_FILTERS - 2] = prefilter;
+    filters_meta[BLOSC2_MAX_FILTERS - 2] = (prefilter != 0) ? cparams->prefilter_meta : 0;
+    filters[BLOSC2_MAX_FILTERS - 1] = cparams->filter;
   }
+}
+
+// Set the cparams_btune inside blosc2_context
+static void set_btune_cparams(blosc2_context * context, cparams_btune * cparams){
+  context->compcode = cparams->compcode;
+
+  set_filters(context->filters, context->filters_meta, cparams, context->schunk->typesize);
 
   context->splitmode = cparams->splitmode;
   context->clevel = cparams->clevel;
   btune_struct *btune_params = (btune_struct*) context->btune_params;
-  // Do not set a too large clevel for ZSTD and BALANCED mode
-  if (btune_params->config.comp_mode == BTUNE_COMP_BALANCED &&
-      (cparams->compcode == BLOSC_ZSTD || cparams->compcode == BLOSC_ZLIB) &&
-      cparams->clevel >= 3) {
-    cparams->clevel = 3;
-  }
-  // Do not set a too large clevel for HCR mode
-  if (btune_params->config.comp_mode == BTUNE_COMP_HCR && cparams->clevel >= 6) {
-    cparams->clevel = 6;
-  }
+  limit_clevel(btune_params, cparams);
   if (cparams->blocksize) {
     context->blocksize = cparams->blocksize;
   } else {
@@ -605,136 +993,1044 @@ static void set_btune_cparams(blosc2_context * context, cparams_btune * cparams)
   }
 }
 
-// Tune some compression parameters based on the context
-void btune_next_cparams(blosc2_context *context) {
+// Probe the current chunk for the model, accounting for the time spent
+static int probe_chunk(blosc2_context *context) {
   btune_struct *btune_params = (btune_struct*) context->btune_params;
+  blosc_timestamp_t last, current;
+  blosc_set_timestamp(&last);
+  int nblocks = btune_model_probe(context);
+  blosc_set_timestamp(&current);
+  double probe_time = blosc_elapsed_secs(last, current);
+  btune_params->probe_time += probe_time;
+  btune_params->stats.nprobes++;
+  btune_params->stats.probe_time += probe_time;
+  btune_params->probed = true;
+  return nblocks;
+}
 
-  // Run inference only for the first chunk
-  int compcode;
-  uint8_t filter;
-  int nchunk = context->schunk->nchunks;
-  if (nchunk == 0) {
-    btune_comp_mode comp_mode = btune_params->config.comp_mode;
-    int error = btune_model_inference(context, comp_mode, &compcode, &filter);
-    if (error == 0) {
-      printf("Inference: chunk=%d codec=%d filter=%d\n", nchunk, compcode, filter);
-      btune_params->codecs[0] = compcode;
-      btune_params->ncodecs = 1;
-      btune_params->filters[0] = filter;
-      btune_params->nfilters = 1;
-    }
-
-    if (getenv("BTUNE_LOG")) {
-      printf("|    Codec   | Filter | Split | C.Level | Blocksize | Shufflesize | C.Threads | D.Threads |"
-             "   Score   |  C.Ratio   |   BTune State   | Readapt | Winner\n");
-    }
+// Run the model inference for the first chunk, and then periodically or when the entropy drifts
+static void run_inference(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  btune_config *config = &btune_params->config;
+  int64_t nchunk = context->schunk->nchunks;
+  if (btune_params->inference_failed) {
+    return;
+  }
+  bool periodic = (nchunk == 0) ||
+                  ((config->inference_interval > 0) && (nchunk % config->inference_interval == 0));
+  if (!periodic && (config->inference_drift <= 0)) {
+    return;
   }
 
-  *btune_params->aux_cparams = *btune_params->best;
-  cparams_btune *cparams = btune_params->aux_cparams;
-
-  switch(btune_params->state){
-    // Tune codec and filter
-    case CODEC_FILTER: {
-      // Cycle codecs, filters and splits
-      int n_filters_splits = btune_params->nfilters * 2;
-      cparams->compcode = btune_params->codecs[btune_params->aux_index / n_filters_splits];
-      cparams->filter = btune_params->filters[(btune_params->aux_index % n_filters_splits) / 2];
-      cparams->splitmode = (btune_params->aux_index % 2) + 1;
-
-      // The first tuning of ZSTD in some modes should start in clevel 3
-      btune_performance_mode perf_mode = btune_params->config.perf_mode;
-      if (
-              (perf_mode == BTUNE_PERF_COMP || perf_mode == BTUNE_PERF_BALANCED) &&
-              (cparams->compcode == BLOSC_ZSTD || cparams->compcode == BLOSC_ZLIB) &&
-              (btune_params->nhards == 0)
-              ) {
-        cparams->clevel = 3;
-      }
-      // Force auto blocksize
-      // cparams->blocksize = 0;
-      btune_params->aux_index++;
-      break;
+  int nblocks = probe_chunk(context);
+  if (nblocks <= 0) {
+    return;
+  }
+  if (!periodic) {
+    float drift = btune_params->probe_cratio - btune_params->inference_cratio;
+    if (drift < 0) {
+      drift = -drift;
+    }
+    if (drift < config->inference_drift * btune_params->inference_cratio) {
+      return;
     }
+  }
 
-      // Tune shuffle size
-    case SHUFFLE_SIZE:
-      btune_params->aux_index++;
-      if (cparams->increasing_shuffle) {
-        // TODO These kind of condition checks should be removed (maybe asserts)
-        if (cparams->shufflesize < MAX_SHUFFLE) {
-          cparams->shufflesize <<= 1;
-        }
-      } else {
-        int min_shuffle = (cparams->filter == 1) ? MIN_SHUFFLE: MIN_BITSHUFFLE;
-        if (cparams->shufflesize > min_shuffle) {
-          cparams->shufflesize >>= 1;
-        }
-      }
-      break;
+  int compcodes[BTUNE_MAX_CANDIDATES];
+  uint8_t filters[BTUNE_MAX_CANDIDATES];
+  uint8_t prefilters[BTUNE_MAX_CANDIDATES];
+  float scores[BTUNE_MAX_CANDIDATES];
+  int maxcandidates = config->ncandidates;
+  if (maxcandidates < 1) {
+    maxcandidates = 1;
+  } else if (maxcandidates > BTUNE_MAX_CANDIDATES) {
+    maxcandidates = BTUNE_MAX_CANDIDATES;
+  }
+  blosc_timestamp_t last, current;
+  blosc_set_timestamp(&last);
+  int ncandidates = btune_model_inference(context, config->comp_mode, maxcandidates,
+                                          compcodes, filters, prefilters, scores);
+  blosc_set_timestamp(&current);
+  btune_params->inference_time = blosc_elapsed_secs(last, current);
+  btune_params->stats.ninferences++;
+  btune_params->stats.inference_time += btune_params->inference_time;
+  if (ncandidates <= 0) {
+    // Do not insist when there is no model to start with
+    btune_params->inference_failed = (nchunk == 0);
+    return;
+  }
+  int ninferred = 0;
+  for (int i = 0; i < ncandidates; i++) {
+    if (btune_params->log) {
+      btune_log(btune_params, "Inference: chunk=%lld codec=%d filter=%d prefilter=%d score=%.3g\n",
+                (long long)nchunk, compcodes[i], filters[i], prefilters[i], scores[i]);
+    }
+    // Only the codecs and filters allowed by the config
+    if (!is_allowed(btune_params, compcodes[i], filters[i])) {
+      continue;
+    }
+    // The model cannot make BTune lossy
+    if ((prefilters[i] == BLOSC_TRUNC_PREC) && (config->trunc_prec_bits == 0)) {
+      prefilters[i] = 0;
+    }
+    // A confident model does not need a safety net
+    if ((ninferred == 0) && (i == 0) && (config->candidates_confidence > 0) &&
+        (scores[0] >= config->candidates_confidence)) {
+      ncandidates = 1;
+    }
+    btune_params->inferred_codecs[ninferred] = compcodes[i];
+    btune_params->inferred_filters[ninferred] = filters[i];
+    btune_params->inferred_prefilters[ninferred] = prefilters[i];
+    ninferred++;
+  }
+  if (ninferred == 0) {
+    return;
+  }
+  ncandidates = ninferred;
+  btune_params->inference_cratio = btune_params->probe_cratio;
+  btune_params->ninferred = ncandidates;
+  // Do not change the candidates in the middle of a CODEC_FILTER sweep
+  if (btune_params->state != CODEC_FILTER || btune_params->aux_index == 0) {
+    apply_inference(btune_params);
+  }
+}
 
-      // Tune the number of threads
-    case THREADS:
-      btune_params->aux_index++;
-      int * nthreads;
-      if (btune_params->threads_for_comp) {
-        nthreads = &cparams->nthreads_comp;
-      } else {
-        nthreads = &cparams->nthreads_decomp;
-      }
-      if (cparams->increasing_nthreads) {
-        if (*nthreads < btune_params->max_threads) {
-          (*nthreads)++;
-        }
-      } else {
-        if (*nthreads > MIN_THREADS) {
-          (*nthreads)--;
-        }
-      }
-      break;
+// Computes the score depending on the perf_mode
+static double score_function(btune_struct *btune_params, double ctime, size_t cbytes,
+                             double dtime) {
+  double write_time = (double) cbytes / btune_params->bandwidth;
+  double read_time = (double) cbytes / btune_params->read_bandwidth;
+  switch (btune_params->config.perf_mode) {
+    case BTUNE_PERF_COMP:
+      return ctime + write_time;
+    case BTUNE_PERF_DECOMP:
+      return read_time + dtime;
+    case BTUNE_PERF_BALANCED:
+      // The transmission is weighted the same as with a single bandwidth
+      return ctime + (write_time + read_time) / 2 + dtime;
+    case BTUNE_PERF_DEADLINE:
+      return ctime;
+    default:
+      fprintf(stderr, "WARNING: unknown performance mode\n");
+      return -1;
+  }
+}
 
-      // Tune compression level
-    case CLEVEL:
-      // Force auto blocksize on hard readapts
-      if (btune_params->readapt_from == HARD){
-        cparams->blocksize = 0;
-      }
-      btune_params->aux_index++;
-      if (cparams->increasing_clevel) {
-        if (cparams->clevel <= (MAX_CLEVEL - btune_params->step_size)) {
-          cparams->clevel += btune_params->step_size;
-          // ZSTD level 9 is extremely slow, so avoid it, always
-          if (cparams->clevel == 9 && cparams->compcode == BLOSC_ZSTD) {
-            cparams->clevel = 8;
-          }
-        }
-      } else {
-        if (cparams->clevel > btune_params->step_size) {
-          cparams->clevel -= btune_params->step_size;
-        }
-      }
-      break;
+// Determines if the cparams with the given score and cratio have improved the deadline mode best
+static bool has_improved_deadline(btune_struct *btune_params, const cparams_btune *best,
+                                  double score, double cratio) {
+  double deadline = btune_params->config.deadline;
+  double hysteresis = btune_params->config.deadline_hysteresis;
+  // The new cparams must be clearly under the deadline, and the best ones are kept until
+  // they really miss it, so that cparams near the deadline do not oscillate
+  bool fits = score <= deadline * (1 - hysteresis);
+  bool best_fits = best->score <= deadline;
+  if (fits && best_fits) {
+    return cratio > best->cratio * (1 + hysteresis);
+  }
+  if (fits || best_fits) {
+    return fits;
+  }
+  // None meets the deadline, get closer to it
+  return score < best->score;
+}
 
-      // Tune block size
-    case BLOCKSIZE:
+// Determines if the cparams with the given score and cratio have improved the best ones
+// depending on the comp_mode
+static bool has_improved(btune_struct *btune_params, const cparams_btune *best,
+                         double score, double cratio) {
+  if (btune_params->config.perf_mode == BTUNE_PERF_DEADLINE) {
+    return has_improved_deadline(btune_params, best, score, cratio);
+  }
+  double score_coef = best->score / score;
+  double cratio_coef = cratio / best->cratio;
+  btune_comp_mode comp_mode = btune_params->config.comp_mode;
+  switch (comp_mode) {
+    case BTUNE_COMP_HSP:
+      return (((cratio_coef > 1) && (score_coef > 1)) ||
+              ((cratio_coef > 0.5) && (score_coef > 2)) ||
+              ((cratio_coef > 0.67) && (score_coef > 1.3)) ||
+              ((cratio_coef > 2) && (score_coef > 0.7)));
+    case BTUNE_COMP_BALANCED:
+      return (((cratio_coef > 1) && (score_coef > 1)) ||
+              ((cratio_coef > 1.1) && (score_coef > 0.8)) ||
+              ((cratio_coef > 1.3) && (score_coef > 0.5)));
+    case BTUNE_COMP_HCR:
+      return cratio_coef > 1;
+    default:
+      fprintf(stderr, "WARNING: unknown compression mode\n");
+      return false;
+
+  }
+}
+
+
+// Skip the initial hard readapt, starting from known-good cparams (from the cache or the group).
+// Returns false, keeping the hard readapt, when the cparams are not allowed by the config.
+static bool start_from_cparams(blosc2_context *context, const cparams_btune *cparams) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  cparams_btune start = *cparams;
+  if (!is_allowed(btune_params, start.compcode, start.filter)) {
+    BTUNE_DEBUG(btune_params, "Cannot start from codec %d and filter %d, not allowed", start.compcode, start.filter);
+    return false;
+  }
+  // Cached or group cparams from a lossy config cannot make BTune lossy
+  if ((start.prefilter == BLOSC_TRUNC_PREC) && (btune_params->config.trunc_prec_bits == 0)) {
+    start.prefilter = 0;
+  }
+  start.prefilter_meta = get_prefilter_meta(btune_params, start.prefilter);
+  // The known threads are only used when tuning them, and never above the maximum
+  if (btune_params->config.threads_mode == BTUNE_THREADS_NONE) {
+    start.nthreads_comp = btune_params->best->nthreads_comp;
+    start.nthreads_decomp = btune_params->best->nthreads_decomp;
+  } else {
+    if (start.nthreads_comp > btune_params->max_threads) {
+      start.nthreads_comp = btune_params->max_threads;
+    }
+    if (start.nthreads_decomp > btune_params->max_threads) {
+      start.nthreads_decomp = btune_params->max_threads;
+    }
+  }
+  *btune_params->best = start;
+  *btune_params->aux_cparams = start;
+  btune_params->aux_index = 0;
+  btune_params->rep_index = 0;
+  // Skip the hard readapt added for not having a hint
+  btune_params->config.cparams_hint = true;
+  btune_params->config.behaviour.nhards_before_stop--;
+  init_with_hint(context);
+  init_step_size(btune_params);
+  return true;
+}
+
+// Take the best cparams of the group if they are newer and better than ours
+static void sync_group(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  btune_group *group = btune_params->config.group;
+  if ((group == NULL) || (btune_params->state == STOP) || (btune_params->rep_index > 0)) {
+    return;
+  }
+  uint64_t version = atomic_load(&group->version);
+  if (version == btune_params->group_version) {
+    return;
+  }
+  bool initial_hard = (btune_params->readapt_from == HARD) && (btune_params->nhards == 0) &&
+                      !btune_params->config.cparams_hint;
+  if (!initial_hard && (btune_params->state != WAITING)) {
+    // Do not change the cparams in the middle of a readapt
+    return;
+  }
+  pthread_mutex_lock(&group->mutex);
+  cparams_btune group_best = group->best;
+  version = atomic_load(&group->version);
+  pthread_mutex_unlock(&group->mutex);
+  btune_params->group_version = version;
+
+  if (initial_hard) {
+    if (start_from_cparams(context, &group_best)) {
+      BTUNE_DEBUG(btune_params, "Starting from the group best (version %llu)", (unsigned long long) version);
+    }
+    return;
+  }
+  cparams_btune *best = btune_params->best;
+  // Their score is not ours without TRUNC_PREC
+  bool lossy = (group_best.prefilter == BLOSC_TRUNC_PREC) &&
+               (btune_params->config.trunc_prec_bits == 0);
+  if (!lossy && is_allowed(btune_params, group_best.compcode, group_best.filter) &&
+      has_improved(btune_params, best, group_best.score, group_best.cratio)) {
+    // Keep our own tuning directions
+    group_best.increasing_clevel = best->increasing_clevel;
+    group_best.increasing_block = best->increasing_block;
+    group_best.increasing_shuffle = best->increasing_shuffle;
+    group_best.increasing_nthreads = best->increasing_nthreads;
+    if (btune_params->config.threads_mode == BTUNE_THREADS_NONE) {
+      group_best.nthreads_comp = best->nthreads_comp;
+      group_best.nthreads_decomp = best->nthreads_decomp;
+    }
+    *best = group_best;
+  }
+}
+
+// Merge our best cparams into the group at the end of a readapt
+static void publish_group(btune_struct *btune_params) {
+  btune_group *group = btune_params->config.group;
+  if (group == NULL) {
+    return;
+  }
+  cparams_btune *best = btune_params->best;
+  pthread_mutex_lock(&group->mutex);
+  if ((atomic_load(&group->version) == 0) ||
+      has_improved(btune_params, &group->best, best->score, best->cratio)) {
+    group->best = *best;
+    btune_params->group_version = atomic_fetch_add(&group->version, 1) + 1;
+  }
+  pthread_mutex_unlock(&group->mutex);
+}
+
+btune_group * btune_group_new(void) {
+  btune_group *group = calloc(1, sizeof(btune_group));
+  if (group == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&group->mutex, NULL) != 0) {
+    free(group);
+    return NULL;
+  }
+  atomic_init(&group->version, 0);
+  return group;
+}
+
+void btune_group_free(btune_group * group) {
+  if (group == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&group->mutex);
+  free(group);
+}
+
+// Start from the cached cparams when the first chunk matches a previous fingerprint
+static void lookup_cache(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  // The cparams given by the user take precedence
+  if ((btune_params->cache_path == NULL) || btune_params->config.cparams_hint) {
+    return;
+  }
+  btune_params->fingerprint = btune_cache_fingerprint(btune_params, context->schunk->typesize);
+  if (btune_params->fingerprint == 0) {
+    return;
+  }
+  cparams_btune cached = *btune_params->best;
+  if (btune_cache_lookup(btune_params->cache_path, btune_params->fingerprint, &cached) < 0) {
+    return;
+  }
+  if (start_from_cparams(context, &cached)) {
+    BTUNE_DEBUG(btune_params, "Tuning cache hit for fingerprint %016llx", (unsigned long long) btune_params->fingerprint);
+  }
+}
+
+// Store the best cparams of the first hard readapt in the tuning cache
+static void store_cache(btune_struct *btune_params) {
+  if ((btune_params->cache_path == NULL) || (btune_params->fingerprint == 0)) {
+    return;
+  }
+  if (btune_cache_store(btune_params->cache_path, btune_params->fingerprint, btune_params->best) < 0) {
+    BTUNE_DEBUG(btune_params, "Cannot store the tuning cache in %s", btune_params->cache_path);
+  }
+}
+
+// Train the online correction of the model with the winner of the CODEC_FILTER sweep
+static void learn_codec_filter(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  cparams_btune *best = btune_params->best;
+  int compcodes[BTUNE_MAX_CODECS * BTUNE_MAX_FILTERS];
+  uint8_t filters[BTUNE_MAX_CODECS * BTUNE_MAX_FILTERS];
+  uint8_t prefilters[BTUNE_MAX_CODECS * BTUNE_MAX_FILTERS];
+  int ntried = 0;
+  if (btune_params->ncandidates > 0) {
+    for (int i = 0; i < btune_params->ncandidates; i++) {
+      compcodes[ntried] = btune_params->candidate_codecs[i];
+      filters[ntried] = btune_params->candidate_filters[i];
+      prefilters[ntried] = btune_params->candidate_prefilters[i];
+      ntried++;
+    }
+  } else {
+    for (int i = 0; i < btune_params->ncodecs; i++) {
+      for (int j = 0; j < btune_params->nfilters; j++) {
+        compcodes[ntried] = btune_params->codecs[i];
+        filters[ntried] = btune_params->filters[j];
+        prefilters[ntried] = btune_params->prefilters[j];
+        ntried++;
+      }
+    }
+  }
+
+  // The best cparams from before the sweep were measured on other data
+  if (!btune_params->readapt_improved) {
+    return;
+  }
+  // Learn from the features of a chunk of the sweep
+  if (!btune_params->probed) {
+    probe_chunk(context);
+  }
+  int winner = -1;
+  for (int i = 0; i < ntried; i++) {
+    if ((compcodes[i] == best->compcode) && (filters[i] == best->filter) &&
+        (prefilters[i] == best->prefilter)) {
+      winner = i;
+      break;
+    }
+  }
+  if (winner < 0) {
+    return;
+  }
+  if (btune_model_learn(context, btune_params->config.comp_mode, ntried, compcodes, filters,
+                        prefilters, winner) < 0) {
+    BTUNE_DEBUG(btune_params, "Cannot train the model with the CODEC_FILTER sweep");
+  }
+}
+
+// Set the codec, filter and split of the given combination of the CODEC_FILTER state
+static void set_codec_filter(btune_struct *btune_params, cparams_btune *cparams, int index) {
+  // Cycle codecs, filters and splits (or only the candidates from the model)
+  if (btune_params->ncandidates > 0) {
+    int ncandidate = index / 2;
+    cparams->compcode = btune_params->candidate_codecs[ncandidate];
+    cparams->filter = btune_params->candidate_filters[ncandidate];
+    cparams->prefilter = btune_params->candidate_prefilters[ncandidate];
+  } else {
+    int n_filters_splits = btune_params->nfilters * 2;
+    int nfilter = (index % n_filters_splits) / 2;
+    cparams->compcode = btune_params->codecs[index / n_filters_splits];
+    cparams->filter = btune_params->filters[nfilter];
+    cparams->prefilter = btune_params->prefilters[nfilter];
+  }
+  cparams->prefilter_meta = get_prefilter_meta(btune_params, cparams->prefilter);
+  cparams->splitmode = (index % 2) + 1;
+
+  // The first tuning of slow codecs in some modes should start in clevel 3
+  btune_performance_mode perf_mode = btune_params->config.perf_mode;
+  if (
+          (perf_mode == BTUNE_PERF_COMP || perf_mode == BTUNE_PERF_BALANCED ||
+           perf_mode == BTUNE_PERF_DEADLINE) &&
+          get_codec_caps(cparams->compcode)->slow &&
+          (btune_params->nhards == 0)
+          ) {
+    cparams->clevel = 3;
+  }
+}
+
+// The cost minimized by the bandit search, following the criteria of the comp_mode
+static double bandit_cost(btune_struct *btune_params, double score, double cratio) {
+  // Missing the deadline always costs more than any cratio under it
+  if (btune_params->config.perf_mode == BTUNE_PERF_DEADLINE) {
+    double deadline = btune_params->config.deadline;
+    return (score > deadline) ? 1 + score / deadline : 1 / cratio;
+  }
+  switch (btune_params->config.comp_mode) {
+    case BTUNE_COMP_HSP:
+      return score;
+    case BTUNE_COMP_BALANCED:
+      return score / cratio;
+    case BTUNE_COMP_HCR:
+      return 1 / cratio;
+    default:
+      return score;
+  }
+}
+
+// Choose the arm with the lowest UCB of its cost, relative to the lowest mean cost
+static int bandit_choose(btune_arm *arms, int narms, double exploration) {
+  int total = 0;
+  double min_mean = DBL_MAX;
+  for (int i = 0; i < narms; i++) {
+    // Try every arm once first
+    if (arms[i].npulls == 0) {
+      return i;
+    }
+    total += arms[i].npulls;
+    double mean = arms[i].cost_sum / arms[i].npulls;
+    if (mean < min_mean) {
+      min_mean = mean;
+    }
+  }
+  int chosen = 0;
+  double chosen_bound = DBL_MAX;
+  for (int i = 0; i < narms; i++) {
+    double mean = arms[i].cost_sum / arms[i].npulls;
+    double bound = mean / min_mean - exploration * sqrt(log((double) total) / arms[i].npulls);
+    if (bound < chosen_bound) {
+      chosen_bound = bound;
+      chosen = i;
+    }
+  }
+  return chosen;
+}
+
+// The number of chunks of the current readapt in bandit mode
+static int bandit_nchunks(btune_struct *btune_params) {
+  int nclevels = (int) (sizeof(btune_params->bandit_clevels) / sizeof(btune_arm));
+  int narms = (nclevels > btune_params->bandit_nblocksizes) ? nclevels : btune_params->bandit_nblocksizes;
+  if (btune_params->readapt_from == HARD) {
+    if (btune_params->config.bandit_nchunks > 0) {
+      return (int) btune_params->config.bandit_nchunks;
+    }
+    int ncodecs = codec_filter_ncombinations(btune_params);
+    return 2 * ((ncodecs > narms) ? ncodecs : narms);
+  }
+  if (btune_params->config.bandit_nchunks > 0) {
+    return (btune_params->config.bandit_nchunks > 1) ? (int) btune_params->config.bandit_nchunks / 2 : 1;
+  }
+  return narms;
+}
+
+// Choose the codec, filter and split (only in hard readapts), clevel and blocksize of the chunk
+static void bandit_next_cparams(blosc2_context *context, cparams_btune *cparams) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  double exploration = btune_params->config.bandit_exploration;
+  int *arms = btune_params->bandit_arms;
+
+  arms[0] = -1;
+  if (btune_params->readapt_from == HARD) {
+    // The combinations change with the model candidates
+    int ncodecs = codec_filter_ncombinations(btune_params);
+    if (ncodecs != btune_params->bandit_ncodecs) {
+      memset(btune_params->bandit_codecs, 0, sizeof(btune_params->bandit_codecs));
+      btune_params->bandit_ncodecs = ncodecs;
+    }
+    arms[0] = bandit_choose(btune_params->bandit_codecs, ncodecs, exploration);
+    set_codec_filter(btune_params, cparams, arms[0]);
+  }
+
+  int nclevels = (int) (sizeof(btune_params->bandit_clevels) / sizeof(btune_arm));
+  arms[1] = bandit_choose(btune_params->bandit_clevels, nclevels, exploration);
+  cparams->clevel = arms[1] + 1;
+
+  // Larger blocksizes than the chunk are not tried
+  int nblocksizes = 1;
+  while ((nblocksizes < btune_params->bandit_nblocksizes) &&
+         ((btune_params->min_blocksize << (nblocksizes - 1)) <= context->sourcesize)) {
+    nblocksizes++;
+  }
+  arms[2] = bandit_choose(btune_params->bandit_blocksizes, nblocksizes, exploration);
+  cparams->blocksize = (arms[2] == 0) ? 0 : btune_params->min_blocksize << (arms[2] - 1);
+}
+
+// Update the arms of the chunk just compressed with its cost
+static void bandit_update(btune_struct *btune_params, cparams_btune *cparams) {
+  double cost = bandit_cost(btune_params, cparams->score, cparams->cratio);
+  int *arms = btune_params->bandit_arms;
+  if (arms[0] >= 0) {
+    btune_params->bandit_codecs[arms[0]].npulls++;
+    btune_params->bandit_codecs[arms[0]].cost_sum += cost;
+  }
+  btune_params->bandit_clevels[arms[1]].npulls++;
+  btune_params->bandit_clevels[arms[1]].cost_sum += cost;
+  btune_params->bandit_blocksizes[arms[2]].npulls++;
+  btune_params->bandit_blocksizes[arms[2]].cost_sum += cost;
+}
+
+// The candidates of a speculative CODEC_FILTER sweep or a trial
+typedef struct {
+  blosc2_context *context;
+  // The tuning context (only read)
+  const uint8_t *src;
+  // The (sampled) data to compress
+  int32_t srcsize;
+  // The size of src
+  cparams_btune *candidates;
+  // The candidates, where their ctime, dtime and cratio are stored
+  int32_t *cbytes;
+  // The compressed size of every candidate (negative on error)
+  int ncandidates;
+  // The number of candidates
+  bool measure_dtime;
+  // Whether to measure the decompression time too
+} speculation;
+
+// Compress (and decompress if needed) the src of the speculation with a candidate
+static int32_t speculate_candidate(speculation *spec, cparams_btune *candidate,
+                                   uint8_t *dest, int32_t destsize, uint8_t *scratch) {
+  blosc2_context *context = spec->context;
+  blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+  cparams.compcode = (uint8_t) candidate->compcode;
+  cparams.clevel = (uint8_t) candidate->clevel;
+  cparams.typesize = candidate->shufflesize;
+  cparams.blocksize = candidate->blocksize;
+  cparams.splitmode = candidate->splitmode;
+  // Time with the threads of the actual chunks
+  cparams.nthreads = (int16_t) ((candidate->nthreads_comp > 0) ? candidate->nthreads_comp : 1);
+  memcpy(cparams.filters, context->filters, BLOSC2_MAX_FILTERS);
+  memcpy(cparams.filters_meta, context->filters_meta, BLOSC2_MAX_FILTERS);
+  set_filters(cparams.filters, cparams.filters_meta, candidate, context->schunk->typesize);
+
+  blosc2_context *cctx = blosc2_create_cctx(cparams);
+  if (cctx == NULL) {
+    return -1;
+  }
+  blosc_timestamp_t last, current;
+  blosc_set_timestamp(&last);
+  int32_t cbytes = blosc2_compress_ctx(cctx, spec->src, spec->srcsize, dest, destsize);
+  blosc_set_timestamp(&current);
+  blosc2_free_ctx(cctx);
+  if (cbytes <= 0) {
+    return -1;
+  }
+  candidate->ctime = blosc_elapsed_secs(last, current);
+  candidate->dtime = 0;
+  if (spec->measure_dtime) {
+    blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+    dparams.nthreads = (int16_t) ((candidate->nthreads_decomp > 0) ? candidate->nthreads_decomp : 1);
+    blosc2_context *dctx = blosc2_create_dctx(dparams);
+    if (dctx == NULL) {
+      return -1;
+    }
+    blosc_set_timestamp(&last);
+    int dsize = blosc2_decompress_ctx(dctx, dest, cbytes, scratch, spec->srcsize);
+    blosc_set_timestamp(&current);
+    blosc2_free_ctx(dctx);
+    if (dsize < 0) {
+      return -1;
+    }
+    candidate->dtime = blosc_elapsed_secs(last, current);
+  }
+  candidate->cratio = (double) spec->srcsize / (double) cbytes;
+  return cbytes;
+}
+
+// Compress the candidates one after the other, so that their times are not distorted by
+// each other
+static void speculate_all(speculation *spec) {
+  int32_t destsize = spec->srcsize + BLOSC2_MAX_OVERHEAD;
+  uint8_t *dest = malloc(destsize);
+  uint8_t *scratch = spec->measure_dtime ? malloc(spec->srcsize) : NULL;
+  bool ok = (dest != NULL) && (!spec->measure_dtime || (scratch != NULL));
+  for (int i = 0; i < spec->ncandidates; i++) {
+    spec->cbytes[i] = ok ? speculate_candidate(spec, &spec->candidates[i], dest, destsize, scratch) : -1;
+  }
+  free(scratch);
+  free(dest);
+}
+
+// A probed block and its estimated cratio, for sorting them
+typedef struct {
+  float cratio;
+  int32_t index;
+} probed_block;
+
+static int compare_probed_blocks(const void *a, const void *b) {
+  float ca = ((const probed_block *) a)->cratio;
+  float cb = ((const probed_block *) b)->cratio;
+  return (ca > cb) - (ca < cb);
+}
+
+// Gather the trial_nblocks probed blocks at evenly spaced quantiles of their cratio, so that
+// the trials see the variety of the chunk.  Returns a newly allocated sample, or NULL when the
+// whole chunk has to be used.
+static uint8_t *gather_trial_blocks(blosc2_context *context, int32_t *samplesize) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  int32_t ntrials = btune_params->config.trial_nblocks;
+  // Probe the chunk if the inference did not do it
+  if (!btune_params->probed) {
+    probe_chunk(context);
+  }
+  int32_t nblocks = btune_params->probe_nblocks;
+  if (nblocks <= ntrials) {
+    return NULL;
+  }
+
+  probed_block *blocks = malloc(nblocks * sizeof(probed_block));
+  if (blocks == NULL) {
+    return NULL;
+  }
+  for (int32_t i = 0; i < nblocks; i++) {
+    blocks[i].cratio = btune_params->probe_instr[i].cratio;
+    blocks[i].index = i;
+  }
+  qsort(blocks, nblocks, sizeof(probed_block), compare_probed_blocks);
+
+  // The same blocks than the probe, kept aligned to the typesize
+  int32_t typesize = context->schunk->typesize;
+  int32_t blocksize = (context->schunk->blocksize > 0) ? context->schunk->blocksize : B2EP_DEFAULT_BLOCKSIZE;
+  uint8_t *sample = malloc((size_t) ntrials * blocksize);
+  if (sample == NULL) {
+    free(blocks);
+    return NULL;
+  }
+  int32_t size = 0;
+  for (int32_t i = 0; i < ntrials; i++) {
+    int32_t index = blocks[(2 * i + 1) * nblocks / (2 * ntrials)].index;
+    int32_t start = index * blocksize / typesize * typesize;
+    int32_t end = (index + 1) * blocksize;
+    if (end > context->srcsize) {
+      end = context->srcsize;
+    }
+    int32_t len = (end - start) / typesize * typesize;
+    memcpy(sample + size, context->src + start, len);
+    size += len;
+  }
+  free(blocks);
+  if (size == 0) {
+    free(sample);
+    return NULL;
+  }
+  *samplesize = size;
+  return sample;
+}
+
+// Whether a speculative candidate beats the current winner.  In the DEADLINE mode the
+// candidates are estimates from the same sample, so the hysteresis meant for keeping the best
+// ones is not applied: the highest cratio among the ones fitting the deadline wins.
+static bool speculation_beats(btune_struct *btune_params, const cparams_btune *winner,
+                              const cparams_btune *candidate) {
+  if (btune_params->config.perf_mode != BTUNE_PERF_DEADLINE) {
+    return has_improved(btune_params, winner, candidate->score, candidate->cratio);
+  }
+  double deadline = btune_params->config.deadline;
+  bool fits = candidate->score <= deadline;
+  bool winner_fits = winner->score <= deadline;
+  if (fits && winner_fits) {
+    return candidate->cratio > winner->cratio;
+  }
+  if (fits || winner_fits) {
+    return fits;
+  }
+  return candidate->score < winner->score;
+}
+
+// Compress some data with all the candidates, returning the index of the winner,
+// or -1 if none could be compressed.  The data is the representative blocks with
+// trial_nblocks, a centered sample with speculative_size or the whole chunk.
+static int speculate(blosc2_context *context, cparams_btune *candidates, int ncandidates) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  btune_config *config = &btune_params->config;
+
+  int32_t typesize = context->schunk->typesize;
+  const uint8_t *src = context->src;
+  int32_t srcsize = context->srcsize;
+  uint8_t *sample = NULL;
+  if (config->trial_nblocks > 0) {
+    sample = gather_trial_blocks(context, &srcsize);
+    if (sample != NULL) {
+      src = sample;
+    }
+  } else if ((config->speculative_size > 0) && (srcsize > config->speculative_size)) {
+    // Compress a centered sample of the chunk if it is too large
+    int32_t size = config->speculative_size / typesize * typesize;
+    if (size > 0) {
+      src += (srcsize - size) / 2 / typesize * typesize;
+      srcsize = size;
+    }
+  }
+
+  speculation spec;
+  spec.context = context;
+  spec.src = src;
+  spec.srcsize = srcsize;
+  spec.ncandidates = ncandidates;
+  spec.measure_dtime = (config->perf_mode == BTUNE_PERF_DECOMP) ||
+                       (config->perf_mode == BTUNE_PERF_BALANCED);
+  spec.candidates = candidates;
+  spec.cbytes = malloc(ncandidates * sizeof(int32_t));
+  if (spec.cbytes == NULL) {
+    free(sample);
+    return -1;
+  }
+  speculate_all(&spec);
+
+  // Pick the winner with the same criteria than the chunk by chunk sweeps, with the times and
+  // sizes of a sample scaled to the whole chunk, as the scores may be compared with the
+  // absolute deadline or the best ones
+  double scale = (double) context->srcsize / (double) srcsize;
+  int winner = -1;
+  for (int i = 0; i < ncandidates; i++) {
+    cparams_btune *candidate = &candidates[i];
+    if (spec.cbytes[i] <= 0) {
+      continue;
+    }
+    candidate->ctime *= scale;
+    candidate->dtime *= scale;
+    size_t cbytes = (size_t) ((double) spec.cbytes[i] * scale);
+    candidate->score = score_function(btune_params, candidate->ctime, cbytes, candidate->dtime);
+    BTUNE_DEBUG(btune_params, "Speculative candidate: codec=%d filter=%d prefilter=%d split=%d clevel=%d score=%.3g cratio=%.3gx",
+                candidate->compcode, candidate->filter, candidate->prefilter, candidate->splitmode, candidate->clevel,
+                candidate->score, candidate->cratio);
+    if ((winner < 0) || speculation_beats(btune_params, &candidates[winner], candidate)) {
+      winner = i;
+    }
+  }
+  free(spec.cbytes);
+  free(sample);
+  return winner;
+}
+
+// Compress the chunk with all the combinations of the CODEC_FILTER state and
+// keep the winner in cparams, so the sweep ends with this chunk.  Returns false when the
+// sweep has to be done chunk by chunk.
+static bool speculate_codec_filter(blosc2_context *context, cparams_btune *cparams) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  btune_config *config = &btune_params->config;
+  int ncombinations = codec_filter_ncombinations(btune_params);
+  if (!(config->speculative || (config->trial_nblocks > 0)) || (btune_params->aux_index != 0) ||
+      (ncombinations < 2) || (context->src == NULL)) {
+    return false;
+  }
+
+  cparams_btune *candidates = malloc(ncombinations * sizeof(cparams_btune));
+  if (candidates == NULL) {
+    return false;
+  }
+  for (int i = 0; i < ncombinations; i++) {
+    candidates[i] = *cparams;
+    set_codec_filter(btune_params, &candidates[i], i);
+    limit_clevel(btune_params, &candidates[i]);
+  }
+  int winner = speculate(context, candidates, ncombinations);
+  if (winner >= 0) {
+    *cparams = candidates[winner];
+  }
+  free(candidates);
+  if (winner < 0) {
+    return false;
+  }
+
+  // The sweep ends with the winner, whose measurement on this chunk is compared with best
+  btune_params->aux_index = ncombinations;
+  btune_params->speculated = true;
+  return true;
+}
+
+// Trial all the clevels of the CLEVEL state on the representative blocks and keep the winner
+// in cparams, so the state ends with this chunk.  Returns false when the clevels have to be
+// tried chunk by chunk.
+static bool speculate_clevel(blosc2_context *context, cparams_btune *cparams) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  if ((btune_params->config.trial_nblocks <= 0) || (btune_params->aux_index != 0) ||
+      (context->src == NULL)) {
+    return false;
+  }
+
+  cparams_btune candidates[MAX_CLEVEL];
+  int ncandidates = 0;
+  for (int clevel = 1; clevel <= MAX_CLEVEL; clevel++) {
+    cparams_btune candidate = *cparams;
+    candidate.clevel = clevel;
+    limit_clevel(btune_params, &candidate);
+    if ((ncandidates > 0) && (candidates[ncandidates - 1].clevel == candidate.clevel)) {
+      continue;
+    }
+    candidates[ncandidates++] = candidate;
+  }
+  if (ncandidates < 2) {
+    return false;
+  }
+  int winner = speculate(context, candidates, ncandidates);
+  if (winner < 0) {
+    return false;
+  }
+  *cparams = candidates[winner];
+  btune_params->aux_index++;
+  btune_params->clevel_swept = true;
+  btune_params->speculated = true;
+  return true;
+}
+
+// Add the bandwidth measurements (0 if not measured) to the moving averages
+static void feed_bandwidth(btune_struct *btune_params, uint64_t bandwidth, uint64_t read_bandwidth) {
+  double smoothing = btune_params->config.bandwidth_smoothing;
+  if (bandwidth > 0) {
+    btune_params->bandwidth = smoothing * (double) bandwidth + (1 - smoothing) * btune_params->bandwidth;
+  }
+  if (read_bandwidth > 0) {
+    btune_params->read_bandwidth = smoothing * (double) read_bandwidth + (1 - smoothing) * btune_params->read_bandwidth;
+  }
+}
+
+// Whether the bandwidth changed more than the threshold since the reference
+static bool bandwidth_shifted(double bandwidth, double reference, float threshold) {
+  double shift = bandwidth / reference;
+  return (shift > 1 + threshold) || (shift < 1 / (1 + threshold));
+}
+
+// Poll the bandwidth callback, re-score the best cparams with the new bandwidth and start a
+// soft readapt if it changed too much
+static void update_bandwidth(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  btune_config *config = &btune_params->config;
+  if (config->bandwidth_callback != NULL) {
+    uint64_t bandwidth = 0;
+    uint64_t read_bandwidth = 0;
+    config->bandwidth_callback(&bandwidth, &read_bandwidth, config->bandwidth_user_data);
+    feed_bandwidth(btune_params, bandwidth, read_bandwidth);
+  }
+  if ((btune_params->bandwidth == btune_params->scored_bandwidth) &&
+      (btune_params->read_bandwidth == btune_params->scored_read_bandwidth)) {
+    return;
+  }
+
+  // Keep the best score comparable with the next chunks
+  cparams_btune *best = btune_params->best;
+  if ((best->ctime > 0) && (best->cratio > 0)) {
+    size_t cbytes = (size_t) ((double) context->sourcesize / best->cratio);
+    best->score = score_function(btune_params, best->ctime, cbytes, best->dtime);
+  }
+  btune_params->scored_bandwidth = btune_params->bandwidth;
+  btune_params->scored_read_bandwidth = btune_params->read_bandwidth;
+
+  float threshold = config->bandwidth_threshold;
+  if ((threshold <= 0) ||
+      !(bandwidth_shifted(btune_params->bandwidth, btune_params->readapt_bandwidth, threshold) ||
+        bandwidth_shifted(btune_params->read_bandwidth, btune_params->readapt_read_bandwidth, threshold))) {
+    return;
+  }
+  btune_params->readapt_bandwidth = btune_params->bandwidth;
+  btune_params->readapt_read_bandwidth = btune_params->read_bandwidth;
+  if ((btune_params->state != WAITING) && (btune_params->state != STOP)) {
+    return;
+  }
+  BTUNE_DEBUG(btune_params, "Bandwidth changed to %.0f bytes/s (read %.0f bytes/s), starting a soft readapt",
+              btune_params->bandwidth, btune_params->read_bandwidth);
+  btune_params->bandwidth_readapt = true;
+  btune_params->resume_state = btune_params->state;
+  btune_params->resume_readapt = btune_params->readapt_from;
+  btune_params->aux_index = 0;
+  init_soft(btune_params);
+}
+
+// Start from the element size detected in the first chunk instead of the typesize
+static void detect_shufflesize(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+  if (!btune_params->config.detect_shufflesize || (context->src == NULL)) {
+    return;
+  }
+  int32_t shufflesize = btune_detect_shufflesize(context->src, context->srcsize, MAX_SHUFFLE);
+  BTUNE_DEBUG(btune_params, "Detected shufflesize: %d (typesize %d)", shufflesize, context->schunk->typesize);
+  // The SHUFFLE_SIZE state only walks powers of two, so take the largest one dividing the
+  // period (e.g. 4 for structs of 3 floats), and only when it is a multiple of the typesize
+  shufflesize &= -shufflesize;
+  if ((shufflesize > 1) && (shufflesize % context->schunk->typesize == 0)) {
+    btune_params->best->shufflesize = shufflesize;
+  }
+}
+
+// Tune some compression parameters based on the context
+static void next_cparams(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->btune_params;
+
+  int64_t nchunk = context->schunk->nchunks;
+  btune_params->probed = false;
+  btune_params->probe_time = 0;
+  btune_params->inference_time = 0;
+  run_inference(context);
+  sync_group(context);
+  update_bandwidth(context);
+  if (nchunk == 0) {
+    detect_shufflesize(context);
+    lookup_cache(context);
+    if (btune_params->log) {
+      btune_log(btune_params, "|    Codec   | Filter | Split | C.Level | Blocksize | Shufflesize | C.Threads | D.Threads |"
+             "   Score   |  C.Ratio   |   BTune State   | Readapt | Winner\n");
+    }
+  }
+
+  // Repeat the same cparams until all the repetitions are measured
+  if ((btune_params->rep_index > 0) && (btune_params->state != STOP)) {
+    set_btune_cparams(context, btune_params->aux_cparams);
+    return;
+  }
+
+  *btune_params->aux_cparams = *btune_params->best;
+  cparams_btune *cparams = btune_params->aux_cparams;
+
+  switch(btune_params->state){
+    // Tune codec and filter
+    case CODEC_FILTER: {
+      if (speculate_codec_filter(context, cparams)) {
+        break;
+      }
+      set_codec_filter(btune_params, cparams, btune_params->aux_index);
+      // Force auto blocksize
+      // cparams->blocksize = 0;
+      btune_params->aux_index++;
+      break;
+    }
+
+      // Tune shuffle size
+    case SHUFFLE_SIZE:
+      btune_params->aux_index++;
+      if (cparams->increasing_shuffle) {
+        // TODO These kind of condition checks should be removed (maybe asserts)
+        if (cparams->shufflesize < MAX_SHUFFLE) {
+          cparams->shufflesize <<= 1;
+        }
+      } else {
+        int min_shuffle = (cparams->filter == 1) ? MIN_SHUFFLE: MIN_BITSHUFFLE;
+        if (cparams->shufflesize > min_shuffle) {
+          cparams->shufflesize >>= 1;
+        }
+      }
+      break;
+
+      // Tune the number of threads
+    case THREADS:
       btune_params->aux_index++;
-      if (BTUNE_DISABLE_BLOCKSIZE) {
+      int * nthreads;
+      if (btune_params->threads_for_comp) {
+        nthreads = &cparams->nthreads_comp;
+      } else {
+        nthreads = &cparams->nthreads_decomp;
+      }
+      if (btune_params->config.threads_mode == BTUNE_THREADS_GEOMETRIC) {
+        // Start from a single thread and double them from the last accepted number
+        *nthreads = (btune_params->aux_index == 1) ? MIN_THREADS : (btune_params->threads_reference * 2);
+        if (*nthreads > btune_params->max_threads) {
+          *nthreads = btune_params->max_threads;
+        }
+      } else if (cparams->increasing_nthreads) {
+        if (*nthreads < btune_params->max_threads) {
+          (*nthreads)++;
+        }
+      } else {
+        if (*nthreads > MIN_THREADS) {
+          (*nthreads)--;
+        }
+      }
+      break;
+
+      // Tune compression level
+    case CLEVEL:
+      // Force auto blocksize on hard readapts
+      if (btune_params->readapt_from == HARD){
+        cparams->blocksize = 0;
+      }
+      if (speculate_clevel(context, cparams)) {
         break;
       }
-      int step_factor = btune_params->step_size - 1;
+      btune_params->aux_index++;
+      if (cparams->increasing_clevel) {
+        if (cparams->clevel <= (MAX_CLEVEL - btune_params->step_size)) {
+          cparams->clevel += btune_params->step_size;
+          int max_clevel = get_codec_caps(cparams->compcode)->max_clevel;
+          if (cparams->clevel > max_clevel) {
+            cparams->clevel = max_clevel;
+          }
+        }
+      } else {
+        if (cparams->clevel > btune_params->step_size) {
+          cparams->clevel -= btune_params->step_size;
+        }
+      }
+      break;
+
+      // Tune block size
+    case BLOCKSIZE:
+      btune_params->aux_index++;
+      // Start from the automatic blocksize if it has not been computed yet
+      if (cparams->blocksize == 0) {
+        cparams->blocksize = context->blocksize;
+      }
       if (cparams->increasing_block) {
-        int32_t new_block = cparams->blocksize * 1 << btune_params->step_size;
-        if ((cparams->blocksize <= (MAX_BLOCK >> step_factor)) &&
-            (new_block <= context->sourcesize)) {
+        int32_t new_block = cparams->blocksize << btune_params->step_size;
+        if ((new_block <= btune_params->max_blocksize) && (new_block <= context->sourcesize)) {
           cparams->blocksize = new_block;
         }
       } else {
-        if (cparams->blocksize >= (MIN_BLOCK << step_factor)) {
-          cparams->blocksize >>= btune_params->step_size;
+        int32_t new_block = cparams->blocksize >> btune_params->step_size;
+        // The blocksize must be a multiple of the typesize
+        if (cparams->shufflesize > 1) {
+          new_block = new_block / cparams->shufflesize * cparams->shufflesize;
+        }
+        if (new_block >= btune_params->min_blocksize) {
+          cparams->blocksize = new_block;
         }
       }
       break;
 
+      // Choose the cparams with the bandit search
+    case BANDIT:
+      btune_params->aux_index++;
+      bandit_next_cparams(context, cparams);
+      break;
+
       // Try without compressing
     case MEMCPY:
       btune_params->aux_index++;
@@ -753,23 +2049,6 @@ void btune_next_cparams(blosc2_context *context) {
   set_btune_cparams(context, cparams);
 }
 
-// Computes the score depending on the perf_mode
-static double score_function(btune_struct *btune_params, double ctime, size_t cbytes,
-                             double dtime) {
-  double reduced_cbytes = (double)cbytes / (double) BTUNE_KB;
-  switch (btune_params->config.perf_mode) {
-    case BTUNE_PERF_COMP:
-      return ctime + reduced_cbytes / btune_params->config.bandwidth;
-    case BTUNE_PERF_DECOMP:
-      return reduced_cbytes / btune_params->config.bandwidth + dtime;
-    case BTUNE_PERF_BALANCED:
-      return ctime + reduced_cbytes / btune_params->config.bandwidth + dtime;
-    default:
-      fprintf(stderr, "WARNING: unknown performance mode\n");
-      return -1;
-  }
-}
-
 static double mean(double const * array, int size) {
   double sum = 0;
   for (int i = 0; i < size; i++) {
@@ -778,32 +2057,66 @@ static double mean(double const * array, int size) {
   return sum / size;
 }
 
-// Determines if btune has improved depending on the comp_mode
-static bool has_improved(btune_struct *btune_params, double score_coef, double cratio_coef) {
-  btune_comp_mode comp_mode = btune_params->config.comp_mode;
-  switch (comp_mode) {
-    case BTUNE_COMP_HSP:
-      return (((cratio_coef > 1) && (score_coef > 1)) ||
-              ((cratio_coef > 0.5) && (score_coef > 2)) ||
-              ((cratio_coef > 0.67) && (score_coef > 1.3)) ||
-              ((cratio_coef > 2) && (score_coef > 0.7)));
-    case BTUNE_COMP_BALANCED:
-      return (((cratio_coef > 1) && (score_coef > 1)) ||
-              ((cratio_coef > 1.1) && (score_coef > 0.8)) ||
-              ((cratio_coef > 1.3) && (score_coef > 0.5)));
-    case BTUNE_COMP_HCR:
-      return cratio_coef > 1;
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+// Combine the measurements of the repetitions (the array may be reordered)
+static double rep_statistic(btune_rep_stat rep_stat, double *array, int size) {
+  if ((size <= 2) || (rep_stat == BTUNE_REP_MEAN)) {
+    return mean(array, size);
+  }
+  qsort(array, size, sizeof(double), compare_doubles);
+  switch (rep_stat) {
+    case BTUNE_REP_MEDIAN:
+      if (size % 2 == 0) {
+        return (array[size / 2 - 1] + array[size / 2]) / 2;
+      }
+      return array[size / 2];
+    case BTUNE_REP_TRIMMED_MEAN: {
+      int trim = size / 4;
+      return mean(array + trim, size - 2 * trim);
+    }
     default:
-      fprintf(stderr, "WARNING: unknown compression mode\n");
-      return false;
+      return mean(array, size);
+  }
+}
 
+// Number of chunks measured for every cparams in the current state
+static int get_nreps(btune_struct *btune_params) {
+  // The waiting states do not try new cparams
+  if ((btune_params->state == WAITING) || (btune_params->config.behaviour.nreps <= 1)) {
+    return 1;
   }
+  return (int) btune_params->config.behaviour.nreps;
 }
 
+// Check if the number of threads just tried improves the compression or decompression time
+static bool has_improved_threads(btune_struct *btune_params, double ctime, double dtime) {
+  double time = btune_params->threads_for_comp ? ctime : dtime;
+  double best_time = btune_params->threads_for_comp ? btune_params->best->ctime : btune_params->best->dtime;
+  if (btune_params->config.threads_mode != BTUNE_THREADS_GEOMETRIC) {
+    return time < best_time;
+  }
+  // The geometric search doubles the threads from its own reference, starting with a single
+  // thread, while the best ones are only replaced by faster ones
+  cparams_btune *aux = btune_params->aux_cparams;
+  int nthreads = btune_params->threads_for_comp ? aux->nthreads_comp : aux->nthreads_decomp;
+  double speedup = (time > 0) ? btune_params->threads_reference_time / time : 0;
+  if ((btune_params->aux_index == 1) || (speedup >= btune_params->config.threads_speedup)) {
+    btune_params->threads_reference = nthreads;
+    btune_params->threads_reference_time = time;
+  }
+  return time < best_time;
+}
 
 static bool cparams_equals(cparams_btune * cp1, cparams_btune * cp2) {
   return ((cp1->compcode == cp2->compcode) &&
           (cp1->filter == cp2->filter) &&
+          (cp1->prefilter == cp2->prefilter) &&
+          (cp1->prefilter_meta == cp2->prefilter_meta) &&
           (cp1->splitmode == cp2->splitmode) &&
           (cp1->clevel == cp2->clevel) &&
           (cp1->blocksize == cp2->blocksize) &&
@@ -813,6 +2126,19 @@ static bool cparams_equals(cparams_btune * cp1, cparams_btune * cp2) {
 }
 
 
+// Whether the chunks with cparams other than the best ones exceed the tuning_budget
+static bool tuning_budget_exceeded(btune_struct *btune_params) {
+  float tuning_budget = btune_params->config.tuning_budget;
+  if ((tuning_budget <= 0) || (btune_params->stats.ctime <= 0)) {
+    return false;
+  }
+  // The initial hard readapt is needed to get any reasonable cparams
+  if ((btune_params->readapt_from == HARD) && (btune_params->nhards == 0)) {
+    return false;
+  }
+  return btune_params->wasted_ctime / btune_params->stats.ctime > tuning_budget;
+}
+
 // Processes which btune_state will come next after a readapt or wait
 static void process_waiting_state(blosc2_context *ctx) {
   btune_struct *btune_params = (btune_struct*) ctx->btune_params;
@@ -823,8 +2149,27 @@ static void process_waiting_state(blosc2_context *ctx) {
     minimum_hards++;
   }
 
-  char* envvar = getenv("BTUNE_LOG");
-  if (envvar != NULL) {
+  // Return to where we were before a readapt triggered by the bandwidth
+  if ((btune_params->readapt_from == SOFT) && btune_params->bandwidth_readapt) {
+    btune_params->bandwidth_readapt = false;
+    publish_group(btune_params);
+    btune_flush_log(btune_params);
+    btune_params->state = btune_params->resume_state;
+    btune_params->readapt_from = btune_params->resume_readapt;
+    return;
+  }
+
+  // Keep waiting while there is no budget for a new readapt
+  if ((btune_params->readapt_from == WAIT) && tuning_budget_exceeded(btune_params)) {
+    return;
+  }
+
+  if (btune_params->readapt_from != WAIT) {
+    publish_group(btune_params);
+    btune_flush_log(btune_params);
+  }
+
+  if (btune_params->log) {
     // Print the winner of the readapt
 //  if (btune_params->readapt_from != WAIT && !btune_params->is_repeating) {
 //    char* compname;
@@ -841,6 +2186,10 @@ static void process_waiting_state(blosc2_context *ctx) {
     case HARD:
       btune_params->nhards++;
       assert(btune_params->nhards > 0);
+      // Never cache cparams that have not been measured
+      if ((btune_params->nhards == 1) && btune_params->readapt_improved) {
+        store_cache(btune_params);
+      }
       // Last hard (initial readapts completed)
       if ((behaviour.nhards_before_stop == minimum_hards) ||
           (btune_params->nhards % behaviour.nhards_before_stop == 0)) {
@@ -922,6 +2271,14 @@ static void process_waiting_state(blosc2_context *ctx) {
         }
       }
   }
+  // Postpone the new readapt while there is no budget
+  if ((btune_params->state != WAITING) && (btune_params->state != STOP) &&
+      tuning_budget_exceeded(btune_params)) {
+    BTUNE_DEBUG(btune_params, "Tuning budget exceeded, postponing the %s readapt",
+                readapt_to_str(btune_params->readapt_from));
+    btune_params->state = WAITING;
+    btune_params->readapt_from = WAIT;
+  }
   // Force soft step size on last hard
   if ((btune_params->readapt_from == HARD) &&
       (btune_params->nhards == (int)(behaviour.nhards_before_stop - 1))) {
@@ -934,19 +2291,34 @@ static void update_aux(blosc2_context * ctx, bool improved) {
   btune_struct *btune_params = ctx->btune_params;
   cparams_btune *best = btune_params->best;
   bool first_time = btune_params->aux_index == 1;
+  // End the readapt when the budget is exhausted (too slow chunks just lose)
+  if ((btune_params->state != WAITING) && (btune_params->state != STOP)) {
+    if (tuning_budget_exceeded(btune_params)) {
+      BTUNE_DEBUG(btune_params, "Tuning budget exhausted in state %s", stcode_to_stname(btune_params));
+      btune_params->aux_index = 0;
+      btune_params->threads_second_phase = false;
+      // The leftovers of a trial must not end the next states early
+      btune_params->clevel_swept = false;
+      btune_params->speculated = false;
+      btune_params->state = WAITING;
+    }
+  }
   switch (btune_params->state) {
     case CODEC_FILTER:
       // Reached last combination of codec filter
-      if (btune_params->aux_index >= (btune_params->ncodecs *  btune_params->nfilters * 2)) {
+      if (btune_params->aux_index >= codec_filter_ncombinations(btune_params)) {
         btune_params->aux_index = 0;
+        if (btune_params->config.online_learning) {
+          learn_codec_filter(ctx);
+        }
 
         int32_t shufflesize = best->shufflesize;
         // Is shufflesize valid or not
-        if (BTUNE_DISABLE_SHUFFLESIZE) {
-          btune_params->state = (BTUNE_DISABLE_THREADS) ? CLEVEL : THREADS;
+        bool is_power_2 = (shufflesize & (shufflesize - 1)) == 0;
+        if (btune_params->config.tune_shufflesize && best->filter && is_power_2) {
+          btune_params->state = SHUFFLE_SIZE;
         } else {
-          bool is_power_2 = (shufflesize & (shufflesize - 1)) == 0;
-          btune_params->state = (best->filter && is_power_2) ? SHUFFLE_SIZE : THREADS;
+          btune_params->state = (btune_params->config.threads_mode == BTUNE_THREADS_NONE) ? CLEVEL : THREADS;
         }
         // max_threads must be greater than 1
         if ((btune_params->state == THREADS) && (btune_params->max_threads == 1)) {
@@ -956,12 +2328,12 @@ static void update_aux(blosc2_context * ctx, bool improved) {
           }
         }
         // Control direction parameters
-        if (!BTUNE_DISABLE_SHUFFLESIZE && btune_params->state == SHUFFLE_SIZE) {
+        if (btune_params->state == SHUFFLE_SIZE) {
           if (has_ended_shuffle(best)) {
             best->increasing_shuffle = !best->increasing_shuffle;
           }
         } else if (btune_params->state == THREADS) {
-          if (has_ended_shuffle(best)) {
+          if (has_ended_threads(btune_params)) {
             best->increasing_nthreads = !best->increasing_nthreads;
           }
         }
@@ -975,7 +2347,7 @@ static void update_aux(blosc2_context * ctx, bool improved) {
       // Can not change parameter or is not improving
       if (has_ended_shuffle(best) || (!improved && !first_time)) {
         btune_params->aux_index = 0;
-        if (!BTUNE_DISABLE_THREADS) {
+        if (btune_params->config.threads_mode != BTUNE_THREADS_NONE) {
           btune_params->state = THREADS;
         }
         else {
@@ -995,45 +2367,53 @@ static void update_aux(blosc2_context * ctx, bool improved) {
       }
       break;
 
-    case THREADS:
-      first_time = (btune_params->aux_index % MAX_STATE_THREADS) == 1;
-      if (!improved && first_time) {
-        best->increasing_nthreads = !best->increasing_nthreads;
-      }
-      // Can not change parameter or is not improving
-      if (has_ended_threads(btune_params) || (!improved && !first_time)) {
-        // If perf_mode BALANCED mark btune_params to change threads for decompression
-        if (btune_params->config.perf_mode == BTUNE_PERF_BALANCED) {
-          if (btune_params->aux_index < MAX_STATE_THREADS) {
-            btune_params->threads_for_comp = !btune_params->threads_for_comp;
-            btune_params->aux_index = MAX_STATE_THREADS;
-            if (has_ended_threads(btune_params)) {
-              best->increasing_nthreads = !best->increasing_nthreads;
-            }
-          }
-          // No BALANCED mark to end
-        } else {
-          btune_params->aux_index = MAX_STATE_THREADS + 1;
+    case THREADS: {
+      bool ended;
+      if (btune_params->config.threads_mode == BTUNE_THREADS_GEOMETRIC) {
+        // Stop when doubling the threads did not give enough speedup or at the maximum
+        cparams_btune *aux = btune_params->aux_cparams;
+        int nthreads = btune_params->threads_for_comp ? aux->nthreads_comp : aux->nthreads_decomp;
+        ended = (btune_params->threads_reference != nthreads) || (nthreads >= btune_params->max_threads);
+      } else {
+        if (!improved && first_time) {
+          best->increasing_nthreads = !best->increasing_nthreads;
         }
-        // THREADS ended
-        if (btune_params->aux_index > MAX_STATE_THREADS) {
-          btune_params->aux_index = 0;
-          btune_params->state = CLEVEL;
-          if (has_ended_clevel(btune_params)) {
-            best->increasing_clevel = !best->increasing_clevel;
-          }
+        // Can not change parameter or is not improving
+        ended = has_ended_threads(btune_params) || (!improved && !first_time);
+      }
+      if (!ended) {
+        break;
+      }
+      btune_params->aux_index = 0;
+      // If perf_mode BALANCED tune the threads for decompression too
+      if ((btune_params->config.perf_mode == BTUNE_PERF_BALANCED) && !btune_params->threads_second_phase) {
+        btune_params->threads_second_phase = true;
+        btune_params->threads_for_comp = !btune_params->threads_for_comp;
+        if (has_ended_threads(btune_params)) {
+          best->increasing_nthreads = !best->increasing_nthreads;
         }
+        break;
+      }
+      // THREADS ended
+      btune_params->threads_second_phase = false;
+      btune_params->state = CLEVEL;
+      if (has_ended_clevel(btune_params)) {
+        best->increasing_clevel = !best->increasing_clevel;
       }
       break;
+    }
 
-    case CLEVEL:
-      if (!improved && first_time) {
+    case CLEVEL: {
+      // A trial may have tried all the clevels in a single chunk
+      bool swept = btune_params->clevel_swept;
+      btune_params->clevel_swept = false;
+      if (!improved && first_time && !swept) {
         best->increasing_clevel = !best->increasing_clevel;
       }
       // Can not change parameter or is not improving
-      if (has_ended_clevel(btune_params) || (!improved && !first_time)) {
+      if (swept || has_ended_clevel(btune_params) || (!improved && !first_time)) {
         btune_params->aux_index = 0;
-        if (!BTUNE_DISABLE_BLOCKSIZE) {
+        if (btune_params->config.tune_blocksize) {
           btune_params->state = BLOCKSIZE;
         }
         else {
@@ -1049,6 +2429,7 @@ static void update_aux(blosc2_context * ctx, bool improved) {
         }
       }
       break;
+    }
 
     case BLOCKSIZE:
       if (!improved && first_time) {
@@ -1070,6 +2451,14 @@ static void update_aux(blosc2_context * ctx, bool improved) {
       }
       break;
 
+    case BANDIT:
+      bandit_update(btune_params, btune_params->aux_cparams);
+      if (btune_params->aux_index >= bandit_nchunks(btune_params)) {
+        btune_params->aux_index = 0;
+        btune_params->state = WAITING;
+      }
+      break;
+
     case MEMCPY:
       btune_params->aux_index = 0;
       btune_params->state = WAITING;
@@ -1083,10 +2472,115 @@ static void update_aux(blosc2_context * ctx, bool improved) {
   }
 }
 
+// Get the decompression time of the chunk just compressed, measuring it only every
+// decomp_sampling chunks, and estimating it from the last measurement otherwise
+static double get_dtime(blosc2_context * context) {
+  btune_struct *btune_params = (btune_struct*)(context->btune_params);
+  cparams_btune *cparams = btune_params->aux_cparams;
+  uint32_t sampling = btune_params->config.decomp_sampling;
+  bool sampled = (sampling <= 1) || (btune_params->steps_count % sampling == 1) ||
+                 ((btune_params->state == THREADS) && !btune_params->threads_for_comp);
+  if (!sampled) {
+    // Repeated cparams are only measured once
+    int rep_index = btune_params->rep_index;
+    if ((rep_index > 0) && (btune_params->current_dtimes[rep_index - 1] > 0)) {
+      return btune_params->current_dtimes[rep_index - 1];
+    }
+    if (cparams_equals(cparams, btune_params->best) && (btune_params->best->dtime > 0)) {
+      return btune_params->best->dtime;
+    }
+    // The candidates of a readapt must be ranked on their own dtimes, not on the speed of
+    // other codecs or clevels
+    if ((btune_params->state == WAITING) && (btune_params->dspeed > 0)) {
+      return (double) context->sourcesize / btune_params->dspeed;
+    }
+  }
+
+  // Decompress into a scratch buffer, as the source may be NULL when evaluated with prefilters.
+  // The dctx is not used if it has a postfilter, as that should only see the actual data.
+  blosc2_context * dctx = btune_params->dctx;
+  if ((dctx == NULL) || (dctx->postfilter != NULL)) {
+    if (btune_params->dtime_dctx == NULL) {
+      blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+      dparams.nthreads = (int16_t) cparams->nthreads_decomp;
+      btune_params->dtime_dctx = blosc2_create_dctx(dparams);
+      if (btune_params->dtime_dctx == NULL) {
+        return 0;
+      }
+    }
+    dctx = btune_params->dtime_dctx;
+    dctx->new_nthreads = (int16_t) cparams->nthreads_decomp;
+  }
+  if (btune_params->dtime_buffer_size < context->sourcesize) {
+    uint8_t *buffer = realloc(btune_params->dtime_buffer, context->sourcesize);
+    if (buffer == NULL) {
+      return 0;
+    }
+    btune_params->dtime_buffer = buffer;
+    btune_params->dtime_buffer_size = context->sourcesize;
+  }
+
+  blosc_timestamp_t last, current;
+  blosc_set_timestamp(&last);
+  int dsize = blosc2_decompress_ctx(dctx, context->dest, context->destsize,
+                                    btune_params->dtime_buffer, context->sourcesize);
+  blosc_set_timestamp(&current);
+  if (dsize < 0) {
+    BTUNE_DEBUG(btune_params, "Error %d decompressing chunk for measuring dtime", dsize);
+    return 0;
+  }
+  double dtime = blosc_elapsed_secs(last, current);
+  if (dtime > 0) {
+    btune_params->dspeed = (double) dsize / dtime;
+  }
+  return dtime;
+}
+
+// Record the statistics of the chunk just compressed with the cparams in aux_cparams
+static void report_chunk(blosc2_context * context, double score, double cratio, double ctime,
+                         double dtime, bool improved) {
+  btune_struct *btune_params = (btune_struct*)(context->btune_params);
+  btune_stats *stats = &btune_params->stats;
+  btune_chunk_stats *chunk = &stats->last;
+  cparams_btune *cparams = btune_params->aux_cparams;
+  chunk->nchunk = stats->nchunks;
+  chunk->state = stcode_to_stname(btune_params);
+  chunk->readapt = readapt_to_str(btune_params->readapt_from);
+  chunk->compcode = cparams->compcode;
+  chunk->filter = cparams->filter;
+  chunk->prefilter = cparams->prefilter;
+  chunk->splitmode = cparams->splitmode;
+  chunk->clevel = cparams->clevel;
+  chunk->blocksize = cparams->blocksize;
+  chunk->shufflesize = cparams->shufflesize;
+  chunk->nthreads_comp = cparams->nthreads_comp;
+  chunk->nthreads_decomp = cparams->nthreads_decomp;
+  chunk->score = score;
+  chunk->cratio = cratio;
+  chunk->ctime = ctime;
+  chunk->dtime = dtime;
+  chunk->probe_time = btune_params->probe_time;
+  chunk->inference_time = btune_params->inference_time;
+  chunk->improved = improved;
+
+  stats->nchunks++;
+  if ((btune_params->state != WAITING) && (btune_params->state != STOP)) {
+    stats->ntuning_chunks++;
+  }
+  stats->ctime += ctime;
+  stats->dtime += dtime;
+  if (btune_params->config.stats_callback != NULL) {
+    btune_params->config.stats_callback(chunk, btune_params->config.stats_user_data);
+  }
+}
+
 // Update btune structs with the compression results
-void btune_update(blosc2_context * context, double ctime) {
+static void update(blosc2_context * context, double ctime) {
   btune_struct *btune_params = (btune_struct*)(context->btune_params);
   if (btune_params->state == STOP) {
+    size_t cbytes = context->destsize;
+    report_chunk(context, score_function(btune_params, ctime, cbytes, 0),
+                 (double) context->sourcesize / (double) cbytes, ctime, 0, false);
     return;
   }
 
@@ -1097,58 +2591,62 @@ void btune_update(blosc2_context * context, double ctime) {
   size_t cbytes = context->destsize;
   double dtime = 0;
 
-  // When the source is NULL (eval with prefilters), decompression is not working.
-  // Disabling this part for the time being.
-//  // Compute the decompression time if needed
-//  btune_behaviour behaviour = btune_params->config.behaviour;
-//  if (!((btune_params->state == WAITING) &&
-//      ((behaviour.nwaits_before_readapt == 0) ||
-//      (btune_params->nwaitings % behaviour.nwaits_before_readapt != 0))) &&
-//      ((btune_params->config.perf_mode == BTUNE_PERF_DECOMP) ||
-//      (btune_params->config.perf_mode == BTUNE_PERF_BALANCED))) {
-//    blosc2_context * dctx;
-//    if (btune_params->dctx == NULL) {
-//      blosc2_dparams params = { btune_params->nthreads_decomp, NULL, NULL, NULL};
-//      dctx = blosc2_create_dctx(params);
-//    } else {
-//      dctx = btune_params->dctx;
-//    }
-//    blosc_set_timestamp(&last);
-//    blosc2_decompress_ctx(dctx, context->dest, context->destsize, (void*)(context->src),
-//                          context->sourcesize);
-//    blosc_set_timestamp(&current);
-//    dtime = blosc_elapsed_secs(last, current);
-//    if (btune_params->dctx == NULL) {
-//      blosc2_free_ctx(dctx);
-//    }
-//  }
+  // Compute the decompression time if needed
+  btune_behaviour behaviour = btune_params->config.behaviour;
+  if (!((btune_params->state == WAITING) &&
+      ((behaviour.nwaits_before_readapt == 0) ||
+      (btune_params->nwaitings % behaviour.nwaits_before_readapt != 0))) &&
+      ((btune_params->config.perf_mode == BTUNE_PERF_DECOMP) ||
+      (btune_params->config.perf_mode == BTUNE_PERF_BALANCED))) {
+    dtime = get_dtime(context);
+  }
 
   double score = score_function(btune_params, ctime, cbytes, dtime);
   assert(score > 0);
   double cratio = (double) context->sourcesize / (double) cbytes;
 
-  cparams->score = score;
-  cparams->cratio = cratio;
-  cparams->ctime = ctime;
-  cparams->dtime = dtime;
   btune_params->current_scores[btune_params->rep_index] = score;
   btune_params->current_cratios[btune_params->rep_index] = cratio;
+  btune_params->current_ctimes[btune_params->rep_index] = ctime;
+  btune_params->current_dtimes[btune_params->rep_index] = dtime;
   btune_params->rep_index++;
-  if (btune_params->rep_index == 1) {
-    score = mean(btune_params->current_scores, 1);
-    cratio = mean(btune_params->current_cratios, 1);
-    double cratio_coef = cratio / btune_params->best->cratio;
-    double score_coef = btune_params->best->score / score;
+  int nreps = get_nreps(btune_params);
+  if (btune_params->rep_index < nreps) {
+    report_chunk(context, score, cratio, ctime, dtime, false);
+  } else {
+    double chunk_score = score;
+    double chunk_cratio = cratio;
+    double chunk_ctime = ctime;
+    double chunk_dtime = dtime;
+    btune_rep_stat rep_stat = btune_params->config.behaviour.rep_stat;
+    score = rep_statistic(rep_stat, btune_params->current_scores, nreps);
+    cratio = rep_statistic(rep_stat, btune_params->current_cratios, nreps);
+    ctime = rep_statistic(rep_stat, btune_params->current_ctimes, nreps);
+    dtime = rep_statistic(rep_stat, btune_params->current_dtimes, nreps);
+    cparams->score = score;
+    cparams->cratio = cratio;
+    cparams->ctime = ctime;
+    cparams->dtime = dtime;
     bool improved;
     // In state THREADS the improvement comes from ctime or dtime
     if (btune_params->state == THREADS) {
-      if (btune_params->threads_for_comp) {
-        improved = ctime < btune_params->best->ctime;
-      } else {
-        improved = dtime < btune_params->best->dtime;
-      }
+      improved = has_improved_threads(btune_params, ctime, dtime);
+    } else if (btune_params->state == BANDIT) {
+      cparams_btune *best = btune_params->best;
+      improved = bandit_cost(btune_params, score, cratio) < bandit_cost(btune_params, best->score, best->cratio);
     } else {
-      improved = has_improved(btune_params, score_coef, cratio_coef);
+      improved = has_improved(btune_params, btune_params->best, score, cratio);
+    }
+    // The winner of a speculative sweep is measured against best like any other candidate,
+    // unless best still holds the unmeasured defaults of the initial hard readapt
+    if (btune_params->speculated) {
+      improved = improved || ((btune_params->readapt_from == HARD) && (btune_params->nhards == 0) &&
+                              !btune_params->config.cparams_hint && !btune_params->readapt_improved);
+      btune_params->speculated = false;
+    }
+    // Too slow cparams can not be the best ones
+    if ((btune_params->config.max_ctime > 0) && (ctime > btune_params->config.max_ctime)) {
+      improved = false;
     }
     char winner = '-';
     // If the chunk is made of special values, it cannot never improve scoring
@@ -1161,12 +2659,11 @@ void btune_update(blosc2_context * context, double ctime) {
     }
 
     if (!btune_params->is_repeating) {
-      char* envvar = getenv("BTUNE_LOG");
-      if (envvar != NULL) {
+      if (btune_params->log) {
         int split = (cparams->splitmode == BLOSC_ALWAYS_SPLIT) ? 1 : 0;
         const char *compname;
         blosc2_compcode_to_compname(cparams->compcode, &compname);
-        printf("| %10s | %6d | %5d | %7d | %9d | %11d | %9d | %9d | %9.3g | %9.3gx | %15s | %7s | %c\n",
+        btune_log(btune_params, "| %10s | %6d | %5d | %7d | %9d | %11d | %9d | %9d | %9.3g | %9.3gx | %15s | %7s | %c\n",
                compname, cparams->filter, split, cparams->clevel,
                (int) cparams->blocksize / BTUNE_KB, (int) cparams->shufflesize,
                cparams->nthreads_comp, cparams->nthreads_decomp,
@@ -1178,10 +2675,72 @@ void btune_update(blosc2_context * context, double ctime) {
     // We don't want to get rid of the previous best->score
     if (improved) {
       *btune_params->best = *cparams;
+      btune_params->readapt_improved = true;
+    }
+    // The best cparams are kept until they miss the deadline, so follow how they do now
+    bool missed_deadline = false;
+    if ((btune_params->config.perf_mode == BTUNE_PERF_DEADLINE) && !improved && (winner != 'S') &&
+        cparams_equals(cparams, btune_params->best)) {
+      cparams_btune *best = btune_params->best;
+      best->score = score;
+      best->cratio = cratio;
+      best->ctime = ctime;
+      best->dtime = dtime;
+      missed_deadline = score > btune_params->config.deadline;
+    }
+    if (!improved && (btune_params->state != WAITING)) {
+      for (int i = 0; i < nreps; i++) {
+        btune_params->wasted_ctime += btune_params->current_ctimes[i];
+      }
     }
     btune_params->rep_index = 0;
+    report_chunk(context, chunk_score, chunk_cratio, chunk_ctime, chunk_dtime, improved);
     update_aux(context, improved);
+    // Do not wait for the next readapt to look for cparams that meet the deadline again
+    if (missed_deadline && (btune_params->state == WAITING) && !tuning_budget_exceeded(btune_params)) {
+      BTUNE_DEBUG(btune_params, "The best cparams missed the deadline (%.3g s), starting a soft readapt", score);
+      btune_params->aux_index = 0;
+      init_soft(btune_params);
+    }
+  }
+}
+
+void btune_next_cparams(blosc2_context *context) {
+  blosc_timestamp_t last, current;
+  blosc_set_timestamp(&last);
+  next_cparams(context);
+  blosc_set_timestamp(&current);
+  btune_struct *btune_params = (btune_struct*)(context->btune_params);
+  btune_params->stats.next_cparams_time += blosc_elapsed_secs(last, current);
+}
+
+void btune_update(blosc2_context * context, double ctime) {
+  blosc_timestamp_t last, current;
+  blosc_set_timestamp(&last);
+  update(context, ctime);
+  blosc_set_timestamp(&current);
+  btune_struct *btune_params = (btune_struct*)(context->btune_params);
+  btune_params->stats.update_time += blosc_elapsed_secs(last, current);
+}
+
+int btune_get_stats(blosc2_context * cctx, btune_stats * stats) {
+  if ((cctx == NULL) || (cctx->btune_params == NULL)) {
+    return -1;
+  }
+  btune_struct *btune_params = (btune_struct*) cctx->btune_params;
+  btune_params->stats.nhards = btune_params->nhards;
+  btune_params->stats.nsofts = btune_params->nsofts;
+  btune_params->stats.nwaitings = btune_params->nwaitings;
+  *stats = btune_params->stats;
+  return 0;
+}
+
+int btune_set_bandwidth(blosc2_context * cctx, uint64_t bandwidth, uint64_t read_bandwidth) {
+  if ((cctx == NULL) || (cctx->btune_params == NULL)) {
+    return -1;
   }
+  feed_bandwidth((btune_struct*) cctx->btune_params, bandwidth, read_bandwidth);
+  return 0;
 }
 
 blosc2_btune_info info = {.btune_init="btune_init", .btune_next_blocksize="btune_next_blocksize",
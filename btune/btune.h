@@ -18,9 +18,16 @@
 
 #include <stdbool.h>
 #include "context.h"
+#include "blosc2_entropy_prober.h"
 
-// The size of L1 cache.  32 KB is quite common nowadays.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The size of L1 cache when it cannot be detected.  32 KB is quite common nowadays.
 #define L1 (32 * 1024)
+// The size of L2 cache when it cannot be detected.  256 KB is quite common nowadays.
+#define L2 (256 * 1024)
 // Version numbers
 #define BTUNE_VERSION_MAJOR    1    /* for major interface/format changes  */
 #define BTUNE_VERSION_MINOR    0    /* for minor interface/format changes  */
@@ -28,32 +35,44 @@
 #define BTUNE_VERSION_STRING "1.0.0"
 // Maximum number of codecs
 #define BTUNE_MAX_CODECS 8
-#define BTUNE_MAX_FILTERS 3
+// Maximum number of filter pipelines
+#define BTUNE_MAX_FILTERS 12
+// Maximum number of codec/filter candidates given by the model
+#define BTUNE_MAX_CANDIDATES 4
+// Maximum number of blocksizes tried by the bandit search
+#define BTUNE_BANDIT_MAX_BLOCKSIZES 16
+
+// Size of the buffer of the BTune logger
+#define BTUNE_LOG_BUFFER_SIZE 4096
 
-#define BTUNE_DEBUG(msg, ...) \
+// Log a debug message if the BTUNE_DEBUG environment variable was set when initializing btune
+#define BTUNE_DEBUG(btune, msg, ...) \
     do { \
-         const char *__e = getenv("BTUNE_DEBUG"); \
-         if (!__e) { break; } \
-         fprintf(stderr, "[DEBUG] " msg "\n", ##__VA_ARGS__); \
+         if (!(btune)->debug) { break; } \
+         btune_log((btune), "[DEBUG] " msg "\n", ##__VA_ARGS__); \
        } while(0)
 
 #define BTUNE_ID 1
 
 /**
- * @brief BTune units enumeration.
+ * @name BTune bandwidth units
  *
- * This enumeration provides the most common units of bandwidth for its use
- * in the BTune config. The bandwidth units are expressed in kB/s.
+ * The most common units of bandwidth for its use in the BTune config.  The bandwidths are
+ * 64-bit values expressed in bytes/s.
+ * @{
 */
-enum bandwidth_units{
-  BTUNE_MBPS = 1024,                                  //!< A 1 MB/s bandwidth expressed in kB/s, 1024 kB/s.
-  BTUNE_MBPS10 = 10 * BTUNE_MBPS,                     //!< A 10 MB/s bandwidth expressed in kB/s, 10240 kB/s.
-  BTUNE_MBPS100 = 100 * BTUNE_MBPS,                   //!< A 100 MB/s bandwidth expressed in kB/s, 102400 kB/s.
-  BTUNE_GBPS = 1 * BTUNE_MBPS * BTUNE_MBPS,           //!< A 1 GB/s bandwidth expressed in kB/s, 1024^2 kB/s.
-  BTUNE_GBPS10 = 10 * BTUNE_MBPS * BTUNE_MBPS,        //!< A 10 GB/s bandwidth expressed in kB/s, 10 * 1024^2 kB/s.
-  BTUNE_GBPS100 = 100 * BTUNE_MBPS * BTUNE_MBPS,      //!< A 100 GB/s bandwidth expressed in kB/s, 100 * 1024^2 kB/s.
-  BTUNE_TBPS = BTUNE_MBPS * BTUNE_MBPS * BTUNE_MBPS,  //!< A 1 TB/s bandwidth expressed in kB/s, 1024^3 kB/s.
-};
+#define BTUNE_KBPS ((uint64_t) 1024)            //!< A 1 kB/s bandwidth expressed in bytes/s.
+#define BTUNE_MBPS (1024 * BTUNE_KBPS)          //!< A 1 MB/s bandwidth expressed in bytes/s, 1024^2 bytes/s.
+#define BTUNE_MBPS10 (10 * BTUNE_MBPS)          //!< A 10 MB/s bandwidth expressed in bytes/s.
+#define BTUNE_MBPS100 (100 * BTUNE_MBPS)        //!< A 100 MB/s bandwidth expressed in bytes/s.
+#define BTUNE_GBPS (1024 * BTUNE_MBPS)          //!< A 1 GB/s bandwidth expressed in bytes/s, 1024^3 bytes/s.
+#define BTUNE_GBPS10 (10 * BTUNE_GBPS)          //!< A 10 GB/s bandwidth expressed in bytes/s.
+#define BTUNE_GBPS100 (100 * BTUNE_GBPS)        //!< A 100 GB/s bandwidth expressed in bytes/s.
+#define BTUNE_TBPS (1024 * BTUNE_GBPS)          //!< A 1 TB/s bandwidth expressed in bytes/s, 1024^4 bytes/s.
+#define BTUNE_TBPS10 (10 * BTUNE_TBPS)          //!< A 10 TB/s bandwidth expressed in bytes/s.
+#define BTUNE_TBPS100 (100 * BTUNE_TBPS)        //!< A 100 TB/s bandwidth expressed in bytes/s.
+#define BTUNE_PBPS (1024 * BTUNE_TBPS)          //!< A 1 PB/s bandwidth expressed in bytes/s, 1024^5 bytes/s.
+/** @} */
 
 /**
  * @brief Compression mode enumeration.
@@ -78,9 +97,37 @@ typedef enum {
 typedef enum {
   BTUNE_PERF_COMP,     //!< Optimizes the compression and transmission times.
   BTUNE_PERF_DECOMP,   //!< Optimizes the decompression and transmission times.
-  BTUNE_PERF_BALANCED  //!< Optimizes the compression, transmission and decompression times.
+  BTUNE_PERF_BALANCED, //!< Optimizes the compression, transmission and decompression times.
+  BTUNE_PERF_DEADLINE  /**< Maximizes the compression ratio keeping the compression time under
+                        * the btune_config#deadline (the comp_mode is not used). */
 } btune_performance_mode;
 
+/**
+ * @brief Threads mode enumeration.
+ *
+ * Changes the way BTune tunes the number of threads for compression and decompression
+ * during the hard readapts.
+*/
+typedef enum {
+  BTUNE_THREADS_NONE,       //!< BTune will not change the number of threads.
+  BTUNE_THREADS_STEP,       //!< BTune will increase or decrease the number of threads one by one.
+  BTUNE_THREADS_GEOMETRIC,  /**< BTune will try 1, 2, 4, ... threads, stopping when doubling
+                             * them does not give the minimum speedup. */
+} btune_threads_mode;
+
+/**
+ * @brief Search mode enumeration.
+ *
+ * Changes the way BTune explores the compression parameters in the readapts.
+*/
+typedef enum {
+  BTUNE_SEARCH_GREEDY,  /**< BTune tunes one parameter after the other (codec and filter, threads,
+                         * clevel, blocksize), moving each one while it improves. */
+  BTUNE_SEARCH_BANDIT,  /**< BTune chooses the codec, filter and split, the clevel and the blocksize
+                         * of every chunk with a multi-armed bandit (UCB), spending more chunks
+                         * on the most promising values. */
+} btune_search_mode;
+
 /**
  * @brief Repeat mode enumeration.
  *
@@ -93,6 +140,19 @@ typedef enum {
   BTUNE_REPEAT_ALL,   //!< BTune will repeat the initial readaptations continuously.
 } btune_repeat_mode;
 
+/**
+ * @brief Repetitions statistic enumeration.
+ *
+ * The statistic used for combining the measurements of the repetitions of the same
+ * compression parameters.
+ * @see #btune_behaviour
+*/
+typedef enum {
+  BTUNE_REP_MEAN,          //!< The mean of the repetitions.
+  BTUNE_REP_MEDIAN,        //!< The median of the repetitions.
+  BTUNE_REP_TRIMMED_MEAN,  //!< The mean of the repetitions without the lowest and highest quarters.
+} btune_rep_stat;
+
 /**
  * @brief BTune behaviour struct.
  *
@@ -119,8 +179,136 @@ typedef struct {
    * Once completed the initial hard readapts, the repeat mode will determine
    * if BTune continues repeating readapts or stops permanently.
   */
+  uint32_t nreps;
+  /**< Number of repetitions of every compression parameters tried in a readapt.
+   *
+   * The same compression parameters are used for this number of chunks and their
+   * measurements are combined with #rep_stat, so every step of a readapt takes
+   * this number of chunks.  When 0 or 1, a single measurement is used.
+  */
+  btune_rep_stat rep_stat;
+  //!< The statistic for combining the repetitions.
 } btune_behaviour;
 
+/**
+ * @brief BTune per chunk statistics.
+ *
+ * The decisions and measurements of BTune for a single chunk.
+ * @see #btune_stats
+*/
+typedef struct {
+  int64_t nchunk;
+  //!< The number of chunks compressed with BTune before this one.
+  const char * state;
+  //!< The BTune state in which the chunk was compressed.
+  const char * readapt;
+  //!< The type of readapt in which the chunk was compressed.
+  int compcode;
+  //!< The codec used.
+  uint8_t filter;
+  //!< The filter used.
+  uint8_t prefilter;
+  //!< The filter applied before #filter (0 for none).
+  int32_t splitmode;
+  //!< The split mode used.
+  int clevel;
+  //!< The compression level used.
+  int32_t blocksize;
+  //!< The blocksize used.
+  int32_t shufflesize;
+  //!< The shuffle size used.
+  int nthreads_comp;
+  //!< The number of threads used for compressing.
+  int nthreads_decomp;
+  //!< The number of threads used for decompressing.
+  double score;
+  //!< The score obtained (lower is better).
+  double cratio;
+  //!< The compression ratio obtained.
+  double ctime;
+  //!< The compression time in seconds.
+  double dtime;
+  //!< The decompression time in seconds (0 if not measured).
+  double probe_time;
+  //!< The time spent by the entropy probe for this chunk in seconds.
+  double inference_time;
+  //!< The time spent by the model inference for this chunk in seconds.
+  bool improved;
+  //!< Whether the cparams of this chunk became the new best.
+} btune_chunk_stats;
+
+/**
+ * @brief BTune statistics.
+ *
+ * The counters accumulated by BTune since its initialization.
+ * @see #btune_get_stats
+*/
+typedef struct {
+  int64_t nchunks;
+  //!< The number of chunks compressed.
+  int64_t ntuning_chunks;
+  //!< The number of chunks compressed during a readapt (not waiting or stopped).
+  int nhards;
+  //!< The number of hard readapts completed.
+  int nsofts;
+  //!< The number of soft readapts completed.
+  int nwaitings;
+  //!< The number of waiting states.
+  int64_t nprobes;
+  //!< The number of chunks probed.
+  int64_t ninferences;
+  //!< The number of model inferences.
+  double probe_time;
+  //!< The total time spent by the entropy probe in seconds.
+  double inference_time;
+  //!< The total time spent by the model inference in seconds.
+  double next_cparams_time;
+  //!< The total time spent in btune_next_cparams() in seconds (including the probe and inference).
+  double update_time;
+  //!< The total time spent in btune_update() in seconds (including the decompression).
+  double ctime;
+  //!< The total compression time in seconds.
+  double dtime;
+  //!< The total time spent measuring the decompression in seconds.
+  btune_chunk_stats last;
+  //!< The statistics of the last chunk.
+} btune_stats;
+
+/**
+ * @brief BTune statistics callback.
+ *
+ * Called after every chunk compressed with the statistics of that chunk.  It runs in the
+ * compression thread, so it should be cheap.
+*/
+typedef void (*btune_stats_callback)(const btune_chunk_stats * stats, void * user_data);
+
+/**
+ * @brief BTune logger callback.
+ *
+ * Called with the buffered log lines (not NUL terminated) when the buffer is full, at the end
+ * of every readapt and when freeing BTune.
+ * @see #btune_config
+*/
+typedef void (*btune_log_callback)(const char * text, size_t len, void * user_data);
+
+/**
+ * @brief BTune bandwidth callback.
+ *
+ * Polled before every chunk for new measurements of the write and read bandwidths in bytes/s,
+ * which are 0 on entry and can be left so when there is none.
+ * @see #btune_set_bandwidth
+*/
+typedef void (*btune_bandwidth_callback)(uint64_t * bandwidth, uint64_t * read_bandwidth, void * user_data);
+
+/**
+ * @brief BTune tuning group.
+ *
+ * An opaque object shared by several BTune instances compressing the same kind of data, so
+ * that they start from and merge into a common best cparams.
+ * @see #btune_group_new
+*/
+typedef struct btune_group_s btune_group;
+
 /**
  * @brief BTune configuration struct.
  *
@@ -128,10 +316,11 @@ typedef struct {
  * how the compression parameters will be tuned.
 */
 typedef struct {
-  uint32_t bandwidth;
-  /**< The bandwidth to which optimize in kB/s.
+  uint64_t bandwidth;
+  /**< The (write) bandwidth to which optimize in bytes/s.
    *
-   * Used to calculate the transmission times.
+   * Used to calculate the transmission times after compressing, and after decompressing too
+   * when #read_bandwidth is 0.
   */
   btune_performance_mode perf_mode;
   //!< The BTune performance mode.
@@ -148,7 +337,241 @@ typedef struct {
    * that this hard readapt is not considered for the number of initial hard readapts.
    * @see #btune_behaviour
   */
-
+  int16_t nthreads_probe;
+  /**< The number of threads for running the entropy probe.
+   *
+   * The blocks of a chunk are probed in parallel before the model inference.
+   * When 0, the number of threads of the compression context is used.
+  */
+  int probe_nwindows;
+  /**< The number of windows probed per block by the entropy probe.
+   *
+   * The windows (of the hash length, 4 KB by default) are evenly strided along the block,
+   * so probing more of them gives better estimates for heterogeneous blocks at a higher
+   * cost.  With 1 only the start of every block is probed.
+  */
+  int32_t probe_budget;
+  /**< The number of bytes per chunk that the entropy probe can look at.
+   *
+   * When not 0, this overrides #probe_nwindows: the budget is spread evenly among the
+   * blocks of the chunk, with at least one window per block.
+  */
+  uint8_t probe_hash_log2;
+  /**< The log2 of the hash size used by the entropy probe, between 12 and 15.
+   *
+   * Larger hashes look at larger windows, which is more accurate but more expensive.
+   * When 0, the default (12) is used.
+  */
+  uint8_t probe_minlen;
+  //!< The minimum length of a match for the entropy probe (0 means the default, 3).
+  uint8_t probe_ipshift;
+  //!< The shift applied at the end of a match by the entropy probe (0 means the default, 3).
+  uint32_t inference_interval;
+  /**< Run the model inference every this number of chunks.
+   *
+   * When 0, the inference only runs for the first chunk.  The codec and filter inferred
+   * become the candidates of the next hard readapt.
+  */
+  float inference_drift;
+  /**< Relative change of the entropy probe cratio that triggers a new inference.
+   *
+   * This allows following data whose entropy drifts over time.  Note that checking
+   * the drift requires probing every chunk.  When 0, the drift is not checked.
+  */
+  uint8_t ncandidates;
+  /**< The maximum number of codec/filter candidates taken from the model.
+   *
+   * The hard readapt only tries these candidates (with and without split), ordered by the
+   * model confidence, instead of the whole codecs x filters sweep.  When 0 or 1, only the
+   * best one is taken.  At most #BTUNE_MAX_CANDIDATES.
+  */
+  float candidates_confidence;
+  /**< The model confidence (mean softmax score) above which only the best candidate is taken.
+   *
+   * The runner-up candidates are a safety net for when the model is uncertain.
+   * When 0, #ncandidates candidates are always taken.
+  */
+  uint32_t decomp_sampling;
+  /**< Measure the decompression time every this number of chunks.
+   *
+   * Only used by the #BTUNE_PERF_DECOMP and #BTUNE_PERF_BALANCED modes, and only while waiting
+   * or for cparams already measured: the readapt candidates are always measured.  In the chunks
+   * not measured, the decompression time is estimated from the last measurement.  When 0 or 1,
+   * every chunk is measured.
+  */
+  bool tune_blocksize;
+  /**< Whether tune the blocksize in the soft readapts or not.
+   *
+   * When true, the blocksize is moved in powers of two after tuning the compression level, between
+   * bounds derived from the detected L1 and L2 cache sizes.  When false, the automatic blocksize is used.
+  */
+  btune_threads_mode threads_mode;
+  //!< The BTune threads mode.
+  float threads_speedup;
+  /**< The minimum speedup for doubling the number of threads in #BTUNE_THREADS_GEOMETRIC mode.
+   *
+   * The search stops at the number of threads where doubling them speeds up the
+   * compression (or decompression) less than this factor.
+  */
+  int16_t max_threads;
+  /**< The maximum number of threads tried in the THREADS state.
+   *
+   * When 0, the number of threads of the compression and decompression contexts is used.
+  */
+  const char * cache_path;
+  /**< The path of the file caching the tuned cparams across super-chunks.
+   *
+   * The best cparams of the first hard readapt are stored keyed by a fingerprint of the
+   * typesize and the entropy probe features of the first chunk.  A later super-chunk with
+   * the same fingerprint starts from them as if #cparams_hint was set, skipping that hard
+   * readapt.  When NULL, the BTUNE_CACHE environment variable is used, and when it is not
+   * set either, the cache is disabled.
+  */
+  btune_group * group;
+  /**< The tuning group shared with other BTune instances, or NULL for none.
+   *
+   * Every member publishes its best cparams to the group at the end of its readapts, and takes
+   * the group best when it is better than its own while waiting.  A member joining a group
+   * (or still in its initial hard readapt) when another one has completed a readapt starts
+   * from the group best as if #cparams_hint was set.
+  */
+  bool speculative;
+  /**< Whether evaluate all the codec and filter combinations of a hard readapt in a single chunk.
+   *
+   * When true, the first chunk of a hard readapt is compressed with every combination, one
+   * after the other with the threads of the actual chunks, and only the winner is used for
+   * the actual chunk.  This needs the chunk source, so it is not done with prefilters.
+  */
+  int32_t speculative_size;
+  /**< The maximum number of bytes compressed with every combination in #speculative mode.
+   *
+   * Larger chunks are sampled from their center.  When 0, the whole chunk is compressed.
+  */
+  btune_stats_callback stats_callback;
+  //!< If not NULL, called with the statistics of every chunk.
+  void * stats_user_data;
+  //!< The user data passed to #stats_callback.
+  btune_log_callback log_callback;
+  /**< If not NULL, receives the BTune log instead of the standard output.
+   *
+   * The log is enabled with the BTUNE_LOG environment variable and the debug messages with
+   * the BTUNE_DEBUG one, both read once in btune_init().
+  */
+  void * log_user_data;
+  //!< The user data passed to #log_callback.
+  btune_search_mode search_mode;
+  //!< The BTune search mode.
+  float bandit_exploration;
+  /**< The exploration factor of the #BTUNE_SEARCH_BANDIT mode.
+   *
+   * Larger values try the less promising values more often.
+  */
+  uint32_t bandit_nchunks;
+  /**< The number of chunks of a hard readapt in #BTUNE_SEARCH_BANDIT mode.
+   *
+   * Soft readapts take half of them.  When 0, it is computed from the number of values to try.
+   * The statistics of the values are kept across the readapts, so the later ones mostly
+   * exploit the best values found.
+  */
+  float tuning_budget;
+  /**< The maximum fraction of the compression time spent on chunks whose cparams did not
+   * become the best ones.
+   *
+   * When exceeded, the current readapt ends and the next ones are postponed until the
+   * fraction goes below it again.  The initial hard readapt is never cut short.
+   * 0 means no limit.
+  */
+  double max_ctime;
+  /**< The maximum compression time of a chunk (in seconds) while tuning.
+   *
+   * Slower cparams never become the best ones, so the readapt moves on to the next
+   * candidates.  0 means no limit.
+  */
+  double deadline;
+  /**< The target compression time of a chunk (in seconds) of the #BTUNE_PERF_DEADLINE mode.
+  */
+  float deadline_hysteresis;
+  /**< The relative margin used in the #BTUNE_PERF_DEADLINE mode.
+   *
+   * New cparams must be this fraction under the #deadline and improve the cratio by this
+   * fraction to replace the best ones, which are kept until they miss the #deadline.  While
+   * waiting, a soft readapt starts as soon as the best ones miss it.
+  */
+  btune_bandwidth_callback bandwidth_callback;
+  //!< If not NULL, polled before every chunk for bandwidth measurements.
+  void * bandwidth_user_data;
+  //!< The user data passed to #bandwidth_callback.
+  float bandwidth_smoothing;
+  /**< The weight of a new bandwidth measurement in the moving average of the bandwidth.
+   *
+   * The #bandwidth is the initial value of the average.
+  */
+  float bandwidth_threshold;
+  /**< The relative change of the bandwidth average that triggers a soft readapt.
+   *
+   * The readapt also happens in the waits and after stopping, and does not count as one of
+   * the #behaviour softs.  0 disables it.
+  */
+  uint64_t read_bandwidth;
+  /**< The read bandwidth in bytes/s, used for the transmission times before decompressing.
+   *
+   * 0 means the same as #bandwidth.
+  */
+  int32_t trial_nblocks;
+  /**< The number of representative blocks of the chunk compressed in trials.
+   *
+   * When greater than 0, the CODEC_FILTER and CLEVEL states try all their candidates on these
+   * blocks (chosen from the quantiles of the entropy probe estimations) in the first chunk of
+   * the state, and only the winner is used for the actual chunk.  This needs the chunk source,
+   * so it is not done with prefilters.  It replaces the #speculative_size sample.
+  */
+  bool tune_shufflesize;
+  /**< Whether BTune tunes the shufflesize (a power of 2 up to 16) after the codec and filter.
+  */
+  bool detect_shufflesize;
+  /**< Whether detect the element size of the data from the periodicity of the first chunk.
+   *
+   * The detected size replaces the typesize as the shufflesize, which helps the shuffle filters
+   * when the data is structured but written with a typesize of 1.  As the shufflesize is kept
+   * a power of two, periods like 3 or 12 bytes give the largest power of two dividing them
+   * (1 and 4), and the typesize is kept when that is not a multiple of it.  It can not be
+   * detected with prefilters.
+  */
+  bool filter_chains;
+  /**< Whether the CODEC_FILTER state also tries DELTA before SHUFFLE and BITSHUFFLE.
+  */
+  int8_t trunc_prec_bits;
+  /**< The precision bits of the lossy TRUNC_PREC filter chains (see the TRUNC_PREC filter meta).
+   *
+   * When not 0, and the typesize is 4 or 8, the CODEC_FILTER state also tries TRUNC_PREC before
+   * SHUFFLE and BITSHUFFLE, and the model candidates may use TRUNC_PREC.  Otherwise BTune never
+   * loses precision.
+  */
+  uint8_t codecs[BTUNE_MAX_CODECS];
+  /**< The codecs BTune may use, including plugin codecs registered with blosc2_register_codec().
+   *
+   * Only the first #ncodecs are used.  The model candidates with other codecs are discarded.
+  */
+  int ncodecs;
+  //!< The number of #codecs, 0 means the default codecs of the comp_mode and perf_mode.
+  uint8_t filters[BTUNE_MAX_FILTERS];
+  /**< The filters BTune may use, including plugin filters registered with blosc2_register_filter().
+   *
+   * Only the first #nfilters are used.  The #filter_chains and TRUNC_PREC chains are only added
+   * for the SHUFFLE and BITSHUFFLE filters in the list.  The model candidates with other filters
+   * are discarded.
+  */
+  int nfilters;
+  //!< The number of #filters, 0 means NOFILTER, SHUFFLE and BITSHUFFLE.
+  bool online_learning;
+  /**< Whether the model scores are corrected with the results of the CODEC_FILTER sweeps.
+   *
+   * Every sweep trains a per-category logistic correction on the probe features, labelling the
+   * tried codec/filter categories with whether they won.  The correction is shared by all the
+   * contexts using the same model, so that it converges to the speeds of the actual hardware.
+  */
+  float learning_rate;
+  //!< The learning rate of the #online_learning correction.
 } btune_config;
 
 /**
@@ -163,8 +586,54 @@ static const btune_config BTUNE_CONFIG_DEFAULTS = {
     2 * BTUNE_GBPS10,
     BTUNE_PERF_BALANCED,
     BTUNE_COMP_BALANCED,
-    {0, 5, 1, BTUNE_STOP},
-    false
+    {0, 5, 1, BTUNE_STOP, 1, BTUNE_REP_MEDIAN},
+    false,
+    0,
+    1,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    1,
+    0,
+    1,
+    false,
+    BTUNE_THREADS_NONE,
+    1.1f,
+    0,
+    NULL,
+    NULL,
+    false,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    BTUNE_SEARCH_GREEDY,
+    0.5f,
+    0,
+    0,
+    0,
+    0.001,
+    0.1f,
+    NULL,
+    NULL,
+    0.2f,
+    0.5f,
+    0,
+    0,
+    false,
+    false,
+    false,
+    0,
+    {0},
+    0,
+    {0},
+    0,
+    false,
+    0.1f
 };
 
 /// @cond DEV
@@ -175,6 +644,7 @@ typedef enum {
     THREADS,
     CLEVEL,
     BLOCKSIZE,
+    BANDIT,
     MEMCPY,
     WAITING,
     STOP,
@@ -193,6 +663,10 @@ typedef struct {
     // The compressor code
     uint8_t filter;
     // The precompression filter
+    uint8_t prefilter;
+    // The filter applied before filter in the pipeline (0 for none)
+    uint8_t prefilter_meta;
+    // The meta of prefilter
     int32_t splitmode;
     // Whether the blocks should be split or not
     int clevel;
@@ -223,6 +697,14 @@ typedef struct {
     // The decompression time obtained with this cparams
 } cparams_btune;
 
+// Statistics of a value (arm) of the bandit search
+typedef struct {
+  int npulls;
+  // The number of chunks compressed with this value
+  double cost_sum;
+  // The sum of the costs obtained with this value
+} btune_arm;
+
 // BTune struct
 typedef struct {
   btune_config config;
@@ -233,6 +715,8 @@ typedef struct {
   // Number of codecs used by BTune
   uint8_t filters[BTUNE_MAX_FILTERS];
   // The filter list used by BTune
+  uint8_t prefilters[BTUNE_MAX_FILTERS];
+  // The filter applied before every filter of the list (0 for none)
   uint8_t nfilters;
   // Number of filters used by BTune
   cparams_btune * best;
@@ -243,6 +727,10 @@ typedef struct {
   // The aux array of scores to calculate the mean
   double * current_cratios;
   // The aux array of cratios to calculate the mean
+  double * current_ctimes;
+  // The aux array of ctimes to calculate the mean
+  double * current_dtimes;
+  // The aux array of dtimes to calculate the mean
   int rep_index;
   // The aux index for the repetitions
   int aux_index;
@@ -271,7 +759,125 @@ typedef struct {
   // The number of threads for decompression (used if dctx is NULL)
   bool threads_for_comp;
   // Depending on this value the THREADS state will change the compression or decompression threads
+  bool threads_second_phase;
+  // If the THREADS state is tuning the decompression threads after the compression ones (BALANCED)
+  int threads_reference;
+  // The last number of threads accepted by the geometric THREADS search
+  double threads_reference_time;
+  // The time measured with threads_reference threads
+  b2ep_prober * prober;
+  // The entropy prober used for the model inference
+  blosc2_instr * probe_instr;
+  // The per-block features computed by the entropy prober
+  int32_t probe_ninstr;
+  // The number of records that fit in probe_instr
+  int32_t probe_nblocks;
+  // The number of blocks probed in the last chunk
+  float probe_cratio;
+  // The mean cratio given by the entropy probe for the last chunk
+  float inference_cratio;
+  // The mean probe cratio of the chunk used in the last inference
+  bool inference_failed;
+  // Whether the model inference failed (e.g. no model available)
+  int ninferred;
+  // The number of inferred candidates waiting for the next hard readapt
+  int inferred_codecs[BTUNE_MAX_CANDIDATES];
+  // The codecs inferred by the model
+  uint8_t inferred_filters[BTUNE_MAX_CANDIDATES];
+  // The filters inferred by the model
+  uint8_t inferred_prefilters[BTUNE_MAX_CANDIDATES];
+  // The prefilters inferred by the model (0 for none)
+  int ncandidates;
+  // The number of codec/filter candidates for the CODEC_FILTER state (0 means all combinations)
+  int candidate_codecs[BTUNE_MAX_CANDIDATES];
+  // The codec of every candidate
+  uint8_t candidate_filters[BTUNE_MAX_CANDIDATES];
+  // The filter of every candidate
+  uint8_t candidate_prefilters[BTUNE_MAX_CANDIDATES];
+  // The prefilter of every candidate (0 for none)
+  blosc2_context * dtime_dctx;
+  // The private decompression context for measuring dtime (used if dctx is NULL or has a postfilter)
+  uint8_t * dtime_buffer;
+  // The scratch buffer for measuring dtime
+  int32_t dtime_buffer_size;
+  // The size of dtime_buffer
+  double dspeed;
+  // The last measured decompression speed (bytes/s)
+  btune_stats stats;
+  // The statistics reported by btune_get_stats
+  double probe_time;
+  // The time spent by the entropy probe in the current chunk
+  double inference_time;
+  // The time spent by the model inference in the current chunk
+  bool speculated;
+  // If the cparams of the current chunk are the winner of a speculative sweep or a trial
+  uint64_t group_version;
+  // The version of the group best last seen
+  char * cache_path;
+  // The path of the tuning cache file (NULL if disabled)
+  uint64_t fingerprint;
+  // The fingerprint of the first chunk for the tuning cache (0 if none)
+  int32_t l1_size;
+  // The detected size of the L1 data cache
+  int32_t l2_size;
+  // The detected size of the L2 cache
+  int32_t min_blocksize;
+  // The minimum blocksize tried in the BLOCKSIZE state
+  int32_t max_blocksize;
+  // The maximum blocksize tried in the BLOCKSIZE state
+  bool log;
+  // If the BTUNE_LOG environment variable was set
+  bool debug;
+  // If the BTUNE_DEBUG environment variable was set
+  char * log_buffer;
+  // The buffer of the logger
+  size_t log_len;
+  // The number of bytes used in log_buffer
+  btune_arm bandit_codecs[BTUNE_MAX_CODECS * BTUNE_MAX_FILTERS * 2];
+  // The bandit arms for the codec, filter and split combinations
+  int bandit_ncodecs;
+  // The number of codec, filter and split arms (changes with the model candidates)
+  btune_arm bandit_clevels[9];
+  // The bandit arms for the clevels from 1 to 9
+  btune_arm bandit_blocksizes[BTUNE_BANDIT_MAX_BLOCKSIZES];
+  // The bandit arms for the automatic blocksize and the powers of two from min_blocksize
+  int bandit_nblocksizes;
+  // The number of blocksize arms
+  int bandit_arms[3];
+  // The codec (-1 in soft readapts), clevel and blocksize arms of the current chunk
+  bool probed;
+  // Whether the current chunk has been probed
+  bool clevel_swept;
+  // Whether a trial has tried all the clevels of the CLEVEL state
+  double wasted_ctime;
+  // The compression time spent on chunks whose cparams did not become the best ones
+  bool readapt_improved;
+  // Whether the best cparams have been replaced in the current readapt
+  double bandwidth;
+  // The moving average of the write bandwidth measurements (bytes/s) used for the scores
+  double read_bandwidth;
+  // The moving average of the read bandwidth measurements (bytes/s) used for the scores
+  double scored_bandwidth;
+  // The write bandwidth used for the score of the best cparams
+  double scored_read_bandwidth;
+  // The read bandwidth used for the score of the best cparams
+  double readapt_bandwidth;
+  // The write bandwidth of the last readapt
+  double readapt_read_bandwidth;
+  // The read bandwidth of the last readapt
+  bool bandwidth_readapt;
+  // Whether the current soft readapt was triggered by a bandwidth change
+  btune_state resume_state;
+  // The state to return to after a bandwidth readapt
+  readapt_type resume_readapt;
+  // The readapt_from to return to after a bandwidth readapt
 } btune_struct;
+
+// Append a formatted message to the log buffer, flushing it when full
+void btune_log(btune_struct * btune, const char * format, ...);
+
+// Send the log buffer to the log callback (or the standard output)
+void btune_flush_log(btune_struct * btune);
 /// @endcond
 
 /**
@@ -295,12 +901,54 @@ typedef struct {
 */
 void btune_init(void * config, blosc2_context* cctx, blosc2_context* dctx);
 
+/**
+ * @brief Create a tuning group.
+ *
+ * The group is set in the #btune_config of every member.  It must outlive all their contexts.
+ * @return The new group, or NULL on error.
+*/
+btune_group * btune_group_new(void);
+
+/**
+ * @brief Free a tuning group.
+ *
+ * @param group The group to free, after freeing the contexts of all its members.
+*/
+void btune_group_free(btune_group * group);
+
 void btune_free(blosc2_context* context);
 
+/**
+ * @brief Get the BTune statistics.
+ *
+ * @param cctx The compression context where BTune was initialized.
+ * @param stats The statistics accumulated since btune_init() and the ones of the last chunk.
+ * @return 0 on success, or a negative value if BTune is not initialized in the context.
+*/
+int btune_get_stats(blosc2_context* cctx, btune_stats * stats);
+
+/**
+ * @brief Feed bandwidth measurements to BTune.
+ *
+ * The measurements are smoothed into the bandwidths used for the scores, and a shift larger
+ * than btune_config#bandwidth_threshold triggers a soft readapt.  It must not be called while
+ * compressing with the context.
+ *
+ * @param cctx The compression context where BTune was initialized.
+ * @param bandwidth The measured write bandwidth in bytes/s, or 0 if not measured.
+ * @param read_bandwidth The measured read bandwidth in bytes/s, or 0 if not measured.
+ * @return 0 on success, or a negative value if BTune is not initialized in the context.
+*/
+int btune_set_bandwidth(blosc2_context* cctx, uint64_t bandwidth, uint64_t read_bandwidth);
+
 void btune_next_cparams(blosc2_context *context);
 
 void btune_update(blosc2_context* context, double ctime);
 
 void btune_next_blocksize(blosc2_context *context);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif  /* BTUNE_H */
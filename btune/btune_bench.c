@@ -0,0 +1,183 @@
+#include <string.h>
+
+#include "btune.h"
+
+#define KB  1024.
+#define MB  (1024*KB)
+
+// Chunks compressed with BTune and the last one whose cparams became the best
+typedef struct {
+    int64_t nchunks;
+    int64_t last_improved;
+} convergence;
+
+static void stats_callback(const btune_chunk_stats *stats, void *user_data)
+{
+    convergence *conv = (convergence *)user_data;
+    conv->nchunks++;
+    if (stats->improved) {
+        conv->last_improved = stats->nchunk;
+    }
+}
+
+static const char *comp_mode_name(btune_comp_mode comp_mode)
+{
+    switch (comp_mode) {
+        case BTUNE_COMP_HSP:
+            return "HSP";
+        case BTUNE_COMP_BALANCED:
+            return "BALANCED";
+        case BTUNE_COMP_HCR:
+            return "HCR";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+static const char *perf_mode_name(btune_performance_mode perf_mode)
+{
+    switch (perf_mode) {
+        case BTUNE_PERF_COMP:
+            return "COMP";
+        case BTUNE_PERF_DECOMP:
+            return "DECOMP";
+        case BTUNE_PERF_BALANCED:
+            return "BALANCED";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+// Compress all the chunks of schunk_in into a new in-memory super chunk, returning the time
+// spent appending them (or a negative value on error)
+static double compress_schunk(blosc2_schunk *schunk_in, blosc2_cparams *cparams, void *data,
+                              int64_t *cbytes, btune_stats *stats)
+{
+    blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+    blosc2_storage storage = {
+        .cparams=cparams,
+        .dparams=&dparams,
+        .contiguous=false,
+        .urlpath=NULL
+    };
+    blosc2_schunk *schunk_out = blosc2_schunk_new(&storage);
+    if (schunk_out == NULL) {
+        fprintf(stderr, "Error creating the destination super chunk\n");
+        return -1;
+    }
+
+    double ttotal = 0;
+    int chunksize = schunk_in->chunksize;
+    for (int nchunk = 0; nchunk < schunk_in->nchunks; nchunk++) {
+        int size = blosc2_schunk_decompress_chunk(schunk_in, nchunk, data, chunksize);
+        if (size < 0) {
+            fprintf(stderr, "Error decompressing chunk %d\n", nchunk);
+            blosc2_schunk_free(schunk_out);
+            return -1;
+        }
+        blosc_timestamp_t t0, t1;
+        blosc_set_timestamp(&t0);
+        if (blosc2_schunk_append_buffer(schunk_out, data, size) < 0) {
+            fprintf(stderr, "Error in appending data to destination super chunk\n");
+            blosc2_schunk_free(schunk_out);
+            return -1;
+        }
+        blosc_set_timestamp(&t1);
+        ttotal += blosc_elapsed_secs(t0, t1);
+    }
+
+    *cbytes = schunk_out->cbytes;
+    if ((stats != NULL) && (btune_get_stats(schunk_out->cctx, stats) < 0)) {
+        memset(stats, 0, sizeof(btune_stats));
+    }
+    blosc2_schunk_free(schunk_out);
+    return ttotal;
+}
+
+static int bench_file(const char *fname)
+{
+    blosc2_schunk *schunk_in = blosc2_schunk_open(fname);
+    if (schunk_in == NULL) {
+        fprintf(stderr, "Input file %s cannot be open.\n", fname);
+        return 1;
+    }
+    void *data = malloc(schunk_in->chunksize);
+    if (data == NULL) {
+        blosc2_schunk_free(schunk_in);
+        return 1;
+    }
+    double nbytes = (double)schunk_in->nbytes;
+
+    // Baseline with fixed cparams
+    blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+    cparams.compcode = BLOSC_LZ4;
+    cparams.clevel = 5;
+    cparams.typesize = schunk_in->typesize;
+    int64_t cbytes;
+    double base_time = compress_schunk(schunk_in, &cparams, data, &cbytes, NULL);
+    if (base_time < 0) {
+        free(data);
+        blosc2_schunk_free(schunk_in);
+        return 1;
+    }
+    double base_cratio = nbytes / (double)cbytes;
+    double base_speed = nbytes / (base_time * MB);
+    printf("%s: %.1f MB in %lld chunks, baseline LZ4 clevel 5: %.2fx, %.1f MB/s\n",
+           fname, nbytes / MB, (long long)schunk_in->nchunks, base_cratio, base_speed);
+    printf("| Comp mode | Perf mode | C.Ratio | vs base |   MB/s   | vs base | Converged | Tuning |"
+           " next_cparams ms | update ms | inference ms | probe ms |\n");
+
+    btune_comp_mode comp_modes[] = {BTUNE_COMP_HSP, BTUNE_COMP_BALANCED, BTUNE_COMP_HCR};
+    btune_performance_mode perf_modes[] = {BTUNE_PERF_COMP, BTUNE_PERF_DECOMP, BTUNE_PERF_BALANCED};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            convergence conv = {0, -1};
+            btune_config btune_config = BTUNE_CONFIG_DEFAULTS;
+            btune_config.comp_mode = comp_modes[i];
+            btune_config.perf_mode = perf_modes[j];
+            btune_config.stats_callback = stats_callback;
+            btune_config.stats_user_data = &conv;
+            cparams = BLOSC2_CPARAMS_DEFAULTS;
+            cparams.typesize = schunk_in->typesize;
+            cparams.btune_id = BTUNE_ID;
+            cparams.btune_params = &btune_config;
+
+            btune_stats stats;
+            double ttotal = compress_schunk(schunk_in, &cparams, data, &cbytes, &stats);
+            if (ttotal < 0) {
+                free(data);
+                blosc2_schunk_free(schunk_in);
+                return 1;
+            }
+            double cratio = nbytes / (double)cbytes;
+            double speed = nbytes / (ttotal * MB);
+            printf("| %9s | %9s | %6.2fx | %6.2fx | %8.1f | %6.2fx | %9lld | %6lld | %15.3f | %9.3f | %12.3f | %8.3f |\n",
+                   comp_mode_name(comp_modes[i]), perf_mode_name(perf_modes[j]),
+                   cratio, cratio / base_cratio, speed, speed / base_speed,
+                   (long long)(conv.last_improved + 1), (long long)stats.ntuning_chunks,
+                   stats.next_cparams_time * 1e3, stats.update_time * 1e3,
+                   stats.inference_time * 1e3, stats.probe_time * 1e3);
+        }
+    }
+
+    free(data);
+    blosc2_schunk_free(schunk_in);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "btune_bench <input.b2frame> [<input.b2frame> ...]\n");
+        return 1;
+    }
+
+    blosc2_init();
+    int rc = 0;
+    for (int i = 1; i < argc; i++) {
+        rc |= bench_file(argv[i]);
+    }
+    blosc2_destroy();
+
+    return rc;
+}
@@ -0,0 +1,192 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "btune.h"
+#include "btune_cache.h"
+
+
+#define CACHE_HEADER "# BTune cache v1\n"
+#define CACHE_LINE_SIZE 128
+#define CRATIO_BINS 8
+#define CSPEED_BINS 4
+// The fraction of blocks in every bin is quantized to this number of levels
+#define HIST_LEVELS 8
+
+// Upper edges of the cratio histogram bins
+static const float cratio_edges[CRATIO_BINS - 1] = {1.1f, 1.5f, 2.f, 3.f, 5.f, 10.f, 20.f};
+
+static uint64_t fnv1a(uint64_t hash, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    hash ^= (value >> (8 * i)) & 0xFF;
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+uint64_t btune_cache_fingerprint(btune_struct * btune, int32_t typesize) {
+  int nblocks = btune->probe_nblocks;
+  if (nblocks <= 0) {
+    return 0;
+  }
+  blosc2_instr *instr = btune->probe_instr;
+  float max_cspeed = 0;
+  for (int i = 0; i < nblocks; i++) {
+    if (instr[i].cspeed > max_cspeed) {
+      max_cspeed = instr[i].cspeed;
+    }
+  }
+
+  // The cspeeds depend on the machine, so only their spread relative to the fastest block is used
+  int cratio_hist[CRATIO_BINS] = {0};
+  int cspeed_hist[CSPEED_BINS] = {0};
+  for (int i = 0; i < nblocks; i++) {
+    int bin = 0;
+    while ((bin < CRATIO_BINS - 1) && (instr[i].cratio >= cratio_edges[bin])) {
+      bin++;
+    }
+    cratio_hist[bin]++;
+    bin = 0;
+    float cspeed = instr[i].cspeed;
+    while ((bin < CSPEED_BINS - 1) && (max_cspeed > 0) && (cspeed * (float)(2 << bin) <= max_cspeed)) {
+      bin++;
+    }
+    cspeed_hist[bin]++;
+  }
+
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  hash = fnv1a(hash, (uint32_t) typesize);
+  hash = fnv1a(hash, (uint32_t) btune->config.perf_mode);
+  hash = fnv1a(hash, (uint32_t) btune->config.comp_mode);
+  // The filter config changes the cparams that can be tuned
+  hash = fnv1a(hash, (uint32_t) btune->config.trunc_prec_bits);
+  hash = fnv1a(hash, (uint32_t) btune->config.filter_chains);
+  hash = fnv1a(hash, (uint32_t) btune->config.ncodecs);
+  for (int i = 0; (i < btune->config.ncodecs) && (i < BTUNE_MAX_CODECS); i++) {
+    hash = fnv1a(hash, (uint32_t) btune->config.codecs[i]);
+  }
+  hash = fnv1a(hash, (uint32_t) btune->config.nfilters);
+  for (int i = 0; (i < btune->config.nfilters) && (i < BTUNE_MAX_FILTERS); i++) {
+    hash = fnv1a(hash, (uint32_t) btune->config.filters[i]);
+  }
+  for (int i = 0; i < CRATIO_BINS; i++) {
+    hash = fnv1a(hash, (uint32_t) ((cratio_hist[i] * HIST_LEVELS + nblocks / 2) / nblocks));
+  }
+  for (int i = 0; i < CSPEED_BINS; i++) {
+    hash = fnv1a(hash, (uint32_t) ((cspeed_hist[i] * HIST_LEVELS + nblocks / 2) / nblocks));
+  }
+  // 0 means no fingerprint
+  return (hash == 0) ? 1 : hash;
+}
+
+// Parse a cache line, returning whether it is a valid entry.  The entries without the
+// prefilter and its meta at the end have been written before filter chains existed.
+static bool parse_entry(const char * line, unsigned long long * fingerprint, cparams_btune * cparams) {
+  int filter;
+  int prefilter = 0;
+  int prefilter_meta = 0;
+  int nread = sscanf(line, "%llx %d %d %d %d %d %d %d %d %d %d", fingerprint,
+                     &cparams->compcode, &filter, &cparams->splitmode, &cparams->clevel,
+                     &cparams->blocksize, &cparams->shufflesize,
+                     &cparams->nthreads_comp, &cparams->nthreads_decomp,
+                     &prefilter, &prefilter_meta);
+  cparams->filter = (uint8_t) filter;
+  cparams->prefilter = (uint8_t) prefilter;
+  cparams->prefilter_meta = (uint8_t) prefilter_meta;
+  return (nread == 9) || (nread == 11);
+}
+
+int btune_cache_lookup(const char * path, uint64_t fingerprint, cparams_btune * cparams) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+  char line[CACHE_LINE_SIZE];
+  int rc = -1;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    unsigned long long entry_fingerprint;
+    cparams_btune entry = *cparams;
+    if (parse_entry(line, &entry_fingerprint, &entry) && (entry_fingerprint == fingerprint)) {
+      *cparams = entry;
+      rc = 0;
+      // Do not stop, the last entry for a fingerprint is the most recent one
+    }
+  }
+  fclose(file);
+  return rc;
+}
+
+int btune_cache_store(const char * path, uint64_t fingerprint, const cparams_btune * cparams) {
+  // Keep the other entries, dropping the oldest ones when the cache is full
+  char (*lines)[CACHE_LINE_SIZE] = malloc(BTUNE_CACHE_MAX_ENTRIES * CACHE_LINE_SIZE);
+  if (lines == NULL) {
+    return -1;
+  }
+  int nlines = 0;
+  int first = 0;
+  FILE *file = fopen(path, "r");
+  if (file != NULL) {
+    char line[CACHE_LINE_SIZE];
+    while (fgets(line, sizeof(line), file) != NULL) {
+      unsigned long long entry_fingerprint;
+      cparams_btune entry;
+      if (!parse_entry(line, &entry_fingerprint, &entry) || (entry_fingerprint == fingerprint)) {
+        continue;
+      }
+      strcpy(lines[(first + nlines) % BTUNE_CACHE_MAX_ENTRIES], line);
+      if (nlines < BTUNE_CACHE_MAX_ENTRIES - 1) {
+        nlines++;
+      } else {
+        first = (first + 1) % BTUNE_CACHE_MAX_ENTRIES;
+      }
+    }
+    fclose(file);
+  }
+
+  // Write a temporary file and rename it, so that concurrent readers never see a partial cache
+  size_t tmp_len = strlen(path) + 5;
+  char *tmp_path = malloc(tmp_len);
+  if (tmp_path == NULL) {
+    free(lines);
+    return -1;
+  }
+  snprintf(tmp_path, tmp_len, "%s.tmp", path);
+  file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    free(tmp_path);
+    free(lines);
+    return -1;
+  }
+  fputs(CACHE_HEADER, file);
+  for (int i = 0; i < nlines; i++) {
+    fputs(lines[(first + i) % BTUNE_CACHE_MAX_ENTRIES], file);
+  }
+  fprintf(file, "%016llx %d %d %d %d %d %d %d %d %d %d\n", (unsigned long long) fingerprint,
+          cparams->compcode, cparams->filter, cparams->splitmode, cparams->clevel,
+          cparams->blocksize, cparams->shufflesize,
+          cparams->nthreads_comp, cparams->nthreads_decomp,
+          cparams->prefilter, cparams->prefilter_meta);
+  int rc = (fclose(file) == 0) ? 0 : -1;
+#if defined(_WIN32)
+  remove(path);
+#endif
+  if ((rc == 0) && (rename(tmp_path, path) != 0)) {
+    rc = -1;
+  }
+  if (rc < 0) {
+    remove(tmp_path);
+  }
+  free(tmp_path);
+  free(lines);
+  return rc;
+}
@@ -0,0 +1,27 @@
+#ifndef BTUNE_CACHE_H
+#define BTUNE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of entries kept in a cache file (the oldest ones are dropped first)
+#define BTUNE_CACHE_MAX_ENTRIES 1024
+
+// Compute the fingerprint of the data from the typesize, the BTune modes, the codec and filter config and a
+// histogram of the features of the last btune_model_probe() call.  Returns 0 if there are no features.
+uint64_t btune_cache_fingerprint(btune_struct * btune, int32_t typesize);
+
+// Look up the fingerprint in the cache file at path, filling the codec, filter, prefilter, split,
+// clevel, blocksize, shufflesize and threads of cparams.  Returns 0 on a hit, or a negative value otherwise.
+int btune_cache_lookup(const char * path, uint64_t fingerprint, cparams_btune * cparams);
+
+// Store the cparams for the fingerprint in the cache file at path, replacing any previous entry.
+// Returns 0 on success, or a negative value on error.
+int btune_cache_store(const char * path, uint64_t fingerprint, const cparams_btune * cparams);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_CACHE_H */
@@ -4,7 +4,6 @@
 #define MB  (1024*KB)
 
 #define CHUNKSIZE (64 * 1024)
-#define BLOCKSIZE ( 8 * 1024)
 
 static int fsize(FILE *file) {
     fseek(file, 0, SEEK_END);
@@ -45,13 +44,13 @@ int main(int argc, char* argv[])
 
     // compression params
     blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
-    cparams.blocksize = BLOCKSIZE; // If unset there's a division by zero crash
 
     // btune
     blosc2_btune *btune = malloc(sizeof(blosc2_btune));
     btune_config btune_config = BTUNE_CONFIG_DEFAULTS;
     //btune_config.comp_mode = BTUNE_COMP_HCR;
     //btune_config.behaviour.repeat_mode = BTUNE_REPEAT_ALL;
+    //btune_config.tune_blocksize = true;
     btune->btune_init = btune_init;
     btune->btune_next_blocksize = btune_next_blocksize;
     btune->btune_next_cparams = btune_next_cparams;
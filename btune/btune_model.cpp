@@ -3,6 +3,14 @@
 #include <tensorflow/lite/model.h>
 #include <tensorflow/lite/optional_debug_tools.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "blosc2.h"
 #include <context.h>
 #include "blosc2_entropy_prober.h"
@@ -12,6 +20,10 @@
 
 
 #define NCODECS 15
+// The features of the online correction: a bias and the normalized cratio/cspeed of a block
+#define NFEATURES 3
+// Keep the logit of the softmax scores finite
+#define MIN_SCORE 1e-4f
 
 #define CHECK(x) \
     if (!(x)) { \
@@ -26,17 +38,39 @@ typedef struct {
     float max;
 } norm_t;
 
+// A model category: a codec and a filter pipeline, where prefilter runs before filter
 typedef struct {
     uint8_t codec;
     uint8_t filter;
+    uint8_t prefilter;
 } category_t;
 
 typedef struct {
     norm_t cratio;
     norm_t cspeed;
     category_t categories[30]; // TODO Make this dynamic with malloc/free
+    int ncategories;
 } metadata_t;
 
+// A model loaded once and shared by all the callers using the same files.
+// Interpreters are not thread safe, so every caller borrows one from the
+// pool of idle interpreters and gives it back when done.
+typedef struct {
+    bool loaded;
+    metadata_t metadata;
+    std::unique_ptr<tflite::FlatBufferModel> model;
+    tflite::ops::builtin::BuiltinOpResolver resolver;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<tflite::Interpreter>> interpreters;
+    // The online logistic correction of every output, learnt from the CODEC_FILTER sweeps
+    std::mutex correction_mutex;
+    float correction[NCODECS][NFEATURES] = {};
+} model_t;
+
+// Process wide model cache, keyed by comp mode + model path + metadata path
+static std::mutex cache_mutex;
+static std::map<std::string, std::unique_ptr<model_t>> cache;
+
 
 static int fsize(FILE *file) {
     fseek(file, 0, SEEK_END);
@@ -45,121 +79,150 @@ static int fsize(FILE *file) {
     return size;
 }
 
-static int get_best_codec(
+// Fold the normalization ((value - mean) / std - min) / max into a
+// single multiply-add, so that it can be vectorized over all the blocks
+static void get_norm_coefs(const norm_t *norm, float *scale, float *offset)
+{
+    *scale = 1 / (norm->std * norm->max);
+    *offset = (-norm->mean / norm->std - norm->min) / norm->max;
+}
+
+// Correct the softmax score of an output with its logistic correction for the block features
+static float correct_score(const float *weights, const float *features, float score)
+{
+    score = std::min(std::max(score, MIN_SCORE), 1 - MIN_SCORE);
+    float z = std::log(score / (1 - score));
+    for (int k = 0; k < NFEATURES; k++) {
+        z += weights[k] * features[k];
+    }
+    return 1 / (1 + std::exp(-z));
+}
+
+// Run the inference for all the blocks at once, leaving the [nblocks, NCODECS] softmax
+// scores in output
+static int invoke_model(
     tflite::Interpreter *interpreter,
-    float cratio,
-    float cspeed
+    const blosc2_instr *instr_data,
+    int nblocks,
+    metadata_t *metadata,
+    const float **output
 )
 {
-    // Fill input tensor
+    // Resize the input tensor to [nblocks, 2] when the batch size changes
+    int input_index = interpreter->inputs()[0];
+    TfLiteTensor *input_tensor = interpreter->tensor(input_index);
+    if (input_tensor->dims->size != 2 || input_tensor->dims->data[0] != nblocks) {
+        CHECK(interpreter->ResizeInputTensor(input_index, {nblocks, 2}) == kTfLiteOk);
+        CHECK(interpreter->AllocateTensors() == kTfLiteOk);
+    }
+
+    // Fill input tensor with the normalized cratio/cspeed of every block
+    float cratio_scale, cratio_offset, cspeed_scale, cspeed_offset;
+    get_norm_coefs(&metadata->cratio, &cratio_scale, &cratio_offset);
+    get_norm_coefs(&metadata->cspeed, &cspeed_scale, &cspeed_offset);
     float* input = interpreter->typed_input_tensor<float>(0);
-    *input = cratio;
-    *(input+1) = cspeed;
+    for (int i = 0; i < nblocks; i++) {
+        input[2 * i] = instr_data[i].cratio * cratio_scale + cratio_offset;
+        input[2 * i + 1] = instr_data[i].cspeed * cspeed_scale + cspeed_offset;
+    }
 
     // Run inference
     CHECK(interpreter->Invoke() == kTfLiteOk);
     //printf("\n\n=== Post-invoke Interpreter State ===\n");
     //tflite::PrintInterpreterState(interpreter);
 
-    // Read output buffers
+    // Read output buffers, a [nblocks, NCODECS] matrix
     // Note: The buffer of the output tensor with index `i` of type T can
     // be accessed with `T* output = interpreter->typed_output_tensor<T>(i);`
-    float* output = interpreter->typed_output_tensor<float>(0);
-
-    int best = 0;
-    float max = -1;
-    for (int i = 0; i < NCODECS; i++) {
-        float value = *output;
-//      printf("%f ", value);
-        output++;
-        if (value > max) {
-            max = value;
-            best = i;
-        }
-    }
-//  printf("-> %d\n\n", best);
+    *output = interpreter->typed_output_tensor<float>(0);
 
-    return best;
+    return 0;
 }
 
-static float normalize(float value, float mean, float std, float min, float max)
+// Run the inference for all the blocks at once and vote for the best codec.
+// The softmax scores of every codec are accumulated in scores too.  When correction
+// is not NULL, the scores are corrected before voting.
+static int vote_best_codecs(
+    tflite::Interpreter *interpreter,
+    const blosc2_instr *instr_data,
+    int nblocks,
+    metadata_t *metadata,
+    const float (*correction)[NFEATURES],
+    int *codecs,
+    float *scores
+)
 {
-    value -= mean;
-    value /= std;
-    value -= min;
-    value /= max;
-    return value;
+    const float *output;
+    int rc = invoke_model(interpreter, instr_data, nblocks, metadata, &output);
+    if (rc < 0) {
+        return rc;
+    }
+
+    const float *input = interpreter->typed_input_tensor<float>(0);
+    for (int i = 0; i < nblocks; i++) {
+        float features[NFEATURES] = {1, input[2 * i], input[2 * i + 1]};
+        int best = 0;
+        float max = -1;
+        for (int j = 0; j < NCODECS; j++) {
+            float value = output[j];
+            if (correction != NULL) {
+                value = correct_score(correction[j], features, value);
+            }
+            scores[j] += value;
+            if (value > max) {
+                max = value;
+                best = j;
+            }
+        }
+        //printf("block=%d -> %d\n", i, best);
+        codecs[best]++;
+        output += NCODECS;
+    }
+
+    return 0;
 }
 
-static int get_best_codec_for_chunk(
-    blosc2_schunk *schunk,
-    const void *src,
-    size_t size,
+// Rank the codecs for the chunk by the number of blocks they win, and then by their
+// mean softmax score.  Returns the number of codecs ranked, and their confidence (the
+// mean score) in scores.
+static int get_best_codecs_for_chunk(
+    btune_struct *btune,
     tflite::Interpreter *interpreter,
-    metadata_t *metadata
+    metadata_t *metadata,
+    const float (*correction)[NFEATURES],
+    int *ranking,
+    float *scores
 )
 {
-    float cratio_mean = metadata->cratio.mean;
-    float cratio_std = metadata->cratio.std;
-    float cratio_min = metadata->cratio.min;
-    float cratio_max = metadata->cratio.max;
-    float cspeed_mean = metadata->cspeed.mean;
-    float cspeed_std = metadata->cspeed.std;
-    float cspeed_min = metadata->cspeed.min;
-    float cspeed_max = metadata->cspeed.max;
-
-    // cparams
-    blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
-    cparams.compcode = ENTROPY_PROBE_ID;
-    cparams.instr_codec = true;  // instrumented (cratio/cspeed)
-    cparams.blocksize = schunk->blocksize;
-    cparams.splitmode = BLOSC_NEVER_SPLIT;
-    cparams.filters[BLOSC2_MAX_FILTERS - 1] = BLOSC_NOFILTER;
-    blosc2_context *cctx = blosc2_create_cctx(cparams);
-
-    // dparams
-    blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
-    blosc2_context *dctx = blosc2_create_dctx(dparams);
-
-    // Compress chunk, this will output the instrumentation data
-    int8_t cdata[size];
-    int csize = blosc2_compress_ctx(cctx, src, size, cdata, sizeof(cdata));
-    if (csize < 0) {
-        printf("Error %d compressing chunk\n", csize);
-        return csize;
-    }
-    // Decompress so we can read the instrumentation data
-    int8_t ddata[size];
-    int dsize = blosc2_decompress_ctx(dctx, cdata, csize, ddata, size);
-    BLOSC_ERROR(dsize);
+    int32_t nblocks = btune->probe_nblocks;
+    if (nblocks <= 0) {
+        return -1;
+    }
+
     // Read the cratio/cspeed for every block
     int codecs[NCODECS] = {0};
-    int nblocks = dsize / (int)sizeof(blosc2_instr);
-    blosc2_instr *instr_data = (blosc2_instr *)ddata;
-    for (int i = 0; i < nblocks; i++) {
-        // Normalize
-        float cratio = normalize(instr_data->cratio, cratio_mean, cratio_std, cratio_min, cratio_max);
-        float cspeed = normalize(instr_data->cspeed, cspeed_mean, cspeed_std, cspeed_min, cspeed_max);
-        //printf("block=%d cratio=%f cspeed=%f\n", i, cratio, cspeed);
-        instr_data++;
-
-        // Run inference
-        int best = get_best_codec(interpreter, cratio, cspeed);
-        codecs[best]++;
+    float sum_scores[NCODECS] = {0};
+    int rc = vote_best_codecs(interpreter, btune->probe_instr, nblocks, metadata, correction,
+                              codecs, sum_scores);
+    if (rc < 0) {
+        return rc;
     }
 
     // The best codec for the chunk is the codec that wins for most blocks
-    int best = -1;
-    int max = 0;
     for (int i = 0; i < NCODECS; i++) {
-        int value = codecs[i];
-        if (value > max) {
-            max = value;
-            best = i;
+        ranking[i] = i;
+    }
+    std::stable_sort(ranking, ranking + NCODECS, [&](int a, int b) {
+        if (codecs[a] != codecs[b]) {
+            return codecs[a] > codecs[b];
         }
+        return sum_scores[a] > sum_scores[b];
+    });
+    for (int i = 0; i < NCODECS; i++) {
+        scores[i] = sum_scores[ranking[i]] / (float)nblocks;
     }
 
-    return best;
+    return NCODECS;
 }
 
 static int read_dict(json_value *json, norm_t *norm)
@@ -184,6 +247,53 @@ static int read_dict(json_value *json, norm_t *norm)
     return 0;
 }
 
+// Read the categories, a list of [codec, filter] or [codec, [stage, ..., filter]] where the
+// stages are a filter pipeline in order.  Only the filter and the stage right before it (the
+// prefilter) are used.
+static int read_categories(json_value *json, metadata_t *metadata)
+{
+    metadata->ncategories = 0;
+    int maxcategories = sizeof(metadata->categories) / sizeof(metadata->categories[0]);
+    if ((json->type != json_array) || ((int)json->u.array.length > maxcategories)) {
+        return -1;
+    }
+    int ncategories = (int)json->u.array.length;
+    for (int i = 0; i < ncategories; i++) {
+        json_value *cat = json->u.array.values[i];
+        if ((cat->type != json_array) || (cat->u.array.length < 2)) {
+            return -1;
+        }
+        json_value *codec = cat->u.array.values[0];
+        json_value *filters = cat->u.array.values[1];
+        if (codec->type != json_integer) {
+            return -1;
+        }
+        category_t *category = &metadata->categories[i];
+        category->codec = (uint8_t)codec->u.integer;
+        category->prefilter = 0;
+        if (filters->type == json_integer) {
+            category->filter = (uint8_t)filters->u.integer;
+            continue;
+        }
+        if ((filters->type != json_array) || (filters->u.array.length == 0)) {
+            return -1;
+        }
+        int nstages = (int)filters->u.array.length;
+        for (int j = 0; j < nstages; j++) {
+            if (filters->u.array.values[j]->type != json_integer) {
+                return -1;
+            }
+        }
+        category->filter = (uint8_t)filters->u.array.values[nstages - 1]->u.integer;
+        if (nstages > 1) {
+            category->prefilter = (uint8_t)filters->u.array.values[nstages - 2]->u.integer;
+        }
+    }
+    metadata->ncategories = ncategories;
+
+    return 0;
+}
+
 static int read_metadata(const char *fname, metadata_t *metadata)
 {
     FILE* file = fopen(fname, "rt");
@@ -198,6 +308,13 @@ static int read_metadata(const char *fname, metadata_t *metadata)
     fread(buffer, size, 1, file);
     buffer[size] = 0;
     json_value *json = json_parse(buffer, size);
+    if (json == NULL || json->type != json_object) {
+        fprintf(stderr, "Error: Cannot parse the %s file\n", fname);
+        json_value_free(json);
+        free(buffer);
+        fclose(file);
+        return -1;
+    }
 
     for (int i = 0; i < json->u.object.length; i++) {
         const char *name = json->u.object.values[i].name;
@@ -209,87 +326,279 @@ static int read_metadata(const char *fname, metadata_t *metadata)
             read_dict(value, &metadata->cspeed);
         }
         else if (strcmp(name, "categories") == 0) {
-            for (int i = 0; i < value->u.array.length; i++) {
-                json_value *cat = value->u.array.values[i];
-                json_value *codec = cat->u.array.values[0];
-                json_value *filter = cat->u.array.values[1];
-                metadata->categories[i].codec = codec->u.integer;
-                metadata->categories[i].filter = filter->u.integer;
+            if (read_categories(value, metadata) < 0) {
+                fprintf(stderr, "Invalid categories in %s\n", fname);
+                json_value_free(json);
+                free(buffer);
+                fclose(file);
+                return -1;
             }
         }
     }
 
+    json_value_free(json);
     free(buffer);
     fclose(file);
     return 0;
 }
 
-int btune_model_inference(blosc2_context * ctx, btune_comp_mode btune_comp, int * compcode, uint8_t * filter)
+// Load the model and its metadata, only done once per cache entry
+static int load_model(model_t *model, const char *metadata_fname, const char *model_fname)
 {
-    metadata_t metadata;
-
-    // Read metadata
-    char * fname = getenv("BTUNE_METADATA");
-    if (fname == NULL) {
-        BTUNE_DEBUG("Environment variable BTUNE_METADATA is not defined");
-        return -1;
-    }
-    int error = read_metadata(fname, &metadata);
+    int error = read_metadata(metadata_fname, &model->metadata);
     if (error) {
         return -1;
     }
 
+    model->model = tflite::FlatBufferModel::BuildFromFile(model_fname);
+    CHECK(model->model != nullptr);
+
+    return 0;
+}
+
+static model_t *get_model(btune_struct *btune, btune_comp_mode btune_comp)
+{
+    // Read metadata
+    const char * metadata_fname = getenv("BTUNE_METADATA");
+    if (metadata_fname == NULL) {
+        BTUNE_DEBUG(btune, "Environment variable BTUNE_METADATA is not defined");
+        return NULL;
+    }
+
     // Load model
+    const char * model_fname;
     switch (btune_comp) {
         case BTUNE_COMP_BALANCED:
-            fname = getenv("BTUNE_MODEL_BALANCED");
+            model_fname = getenv("BTUNE_MODEL_BALANCED");
             break;
         case BTUNE_COMP_HCR:
-            fname = getenv("BTUNE_MODEL_HCR");
+            model_fname = getenv("BTUNE_MODEL_HCR");
             break;
         case BTUNE_COMP_HSP:
-            fname = getenv("BTUNE_MODEL_HSP");
+            model_fname = getenv("BTUNE_MODEL_HSP");
             break;
         default:
-            fname = NULL;
+            model_fname = NULL;
     }
-    if (fname == NULL) {
-        BTUNE_DEBUG("Environment variable BTUNE_MODEL_XXX is not defined");
-        return -1;
+    if (model_fname == NULL) {
+        BTUNE_DEBUG(btune, "Environment variable BTUNE_MODEL_XXX is not defined");
+        return NULL;
+    }
+
+    std::string key = std::to_string(btune_comp) + ":" + model_fname + ":" + metadata_fname;
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::unique_ptr<model_t> &model = cache[key];
+    if (model == nullptr) {
+        // Failures are cached too, so a missing model costs a lookup only
+        model = std::make_unique<model_t>();
+        model->loaded = (load_model(model.get(), metadata_fname, model_fname) == 0);
     }
-    std::unique_ptr<tflite::FlatBufferModel> model = tflite::FlatBufferModel::BuildFromFile(fname);
-    CHECK(model != nullptr);
 
-    // Register entropy codec
-    blosc2_codec codec;
-    b2ep_register_codec(&codec);
+    return model->loaded ? model.get() : NULL;
+}
+
+// Borrow an idle interpreter from the model, or build a new one
+static std::unique_ptr<tflite::Interpreter> acquire_interpreter(model_t *model)
+{
+    std::unique_ptr<tflite::Interpreter> interpreter;
+    {
+        std::lock_guard<std::mutex> lock(model->mutex);
+        if (!model->interpreters.empty()) {
+            interpreter = std::move(model->interpreters.back());
+            model->interpreters.pop_back();
+            return interpreter;
+        }
+    }
 
     // Build the interpreter with the InterpreterBuilder.
     // Note: all Interpreters should be built with the InterpreterBuilder,
     // which allocates memory for the Interpreter and does various set up
     // tasks so that the Interpreter can read the provided model.
-    tflite::ops::builtin::BuiltinOpResolver resolver;
-    tflite::InterpreterBuilder builder(*model, resolver);
-    std::unique_ptr<tflite::Interpreter> interpreter;
+    tflite::InterpreterBuilder builder(*model->model, model->resolver);
     builder(&interpreter);
-    CHECK(interpreter != nullptr);
+    if (interpreter == nullptr) {
+        return nullptr;
+    }
 
     // Allocate tensor buffers.
-    CHECK(interpreter->AllocateTensors() == kTfLiteOk);
+    if (interpreter->AllocateTensors() != kTfLiteOk) {
+        return nullptr;
+    }
     //printf("=== Pre-invoke Interpreter State ===\n");
     //tflite::PrintInterpreterState(interpreter.get());
 
+    return interpreter;
+}
+
+static void release_interpreter(model_t *model, std::unique_ptr<tflite::Interpreter> interpreter)
+{
+    std::lock_guard<std::mutex> lock(model->mutex);
+    model->interpreters.push_back(std::move(interpreter));
+}
+
+int btune_model_probe(blosc2_context * ctx)
+{
+    btune_struct *btune = (btune_struct *)ctx->btune_params;
     const void *src = (const void*)ctx->src;
     int32_t size = ctx->srcsize;
-    int best = get_best_codec_for_chunk(ctx->schunk, src, size, interpreter.get(), &metadata);
-    if (best < 0) {
-        return best;
+    btune->probe_nblocks = 0;
+    if (src == NULL) {
+        BTUNE_DEBUG(btune, "Cannot probe a chunk without source (evaluated with prefilters?)");
+        return -1;
     }
 
-    // Return compcode and filter
-    category_t cat = metadata.categories[best];
-    *compcode = cat.codec;
-    *filter = cat.filter;
+    // Make room for the cratio/cspeed of every block
+    int32_t blocksize = ctx->schunk->blocksize;
+    int32_t nblocks = b2ep_nblocks(size, blocksize);
+    if (nblocks > btune->probe_ninstr) {
+        blosc2_instr *probe_instr = (blosc2_instr *)realloc(btune->probe_instr, nblocks * sizeof(blosc2_instr));
+        CHECK(probe_instr != NULL);
+        btune->probe_instr = probe_instr;
+        btune->probe_ninstr = nblocks;
+    }
 
-    return 0;
+    // Probe the chunk, this will output the instrumentation data
+    nblocks = b2ep_probe(btune->prober, (const uint8_t *)src, size, blocksize,
+                         btune->probe_instr, btune->probe_ninstr);
+    if (nblocks < 0) {
+        fprintf(stderr, "Error %d probing chunk\n", nblocks);
+        return nblocks;
+    }
+
+    float cratio = 0;
+    for (int i = 0; i < nblocks; i++) {
+        cratio += btune->probe_instr[i].cratio;
+    }
+    btune->probe_nblocks = nblocks;
+    btune->probe_cratio = (nblocks > 0) ? cratio / (float)nblocks : 0;
+
+    return nblocks;
+}
+
+int btune_model_inference(blosc2_context * ctx, btune_comp_mode btune_comp, int maxcandidates,
+                          int * compcodes, uint8_t * filters, uint8_t * prefilters, float * scores)
+{
+    btune_struct *btune = (btune_struct *)ctx->btune_params;
+    model_t *model = get_model(btune, btune_comp);
+    if (model == NULL) {
+        return -1;
+    }
+
+    // Take a snapshot of the correction, as other contexts may be learning
+    float correction[NCODECS][NFEATURES];
+    if (btune->config.online_learning) {
+        std::lock_guard<std::mutex> lock(model->correction_mutex);
+        memcpy(correction, model->correction, sizeof(correction));
+    }
+
+    std::unique_ptr<tflite::Interpreter> interpreter = acquire_interpreter(model);
+    CHECK(interpreter != nullptr);
+
+    int ranking[NCODECS];
+    float ranking_scores[NCODECS];
+    int nranked = get_best_codecs_for_chunk(btune, interpreter.get(), &model->metadata,
+                                            btune->config.online_learning ? correction : NULL,
+                                            ranking, ranking_scores);
+    release_interpreter(model, std::move(interpreter));
+    if (nranked < 0) {
+        return nranked;
+    }
+
+    // Return the compcode and filter of the best candidates
+    int ncandidates = 0;
+    for (int i = 0; i < nranked && ncandidates < maxcandidates; i++) {
+        // The model may have more outputs than categories in the metadata
+        if (ranking[i] >= model->metadata.ncategories) {
+            continue;
+        }
+        category_t cat = model->metadata.categories[ranking[i]];
+        compcodes[ncandidates] = cat.codec;
+        filters[ncandidates] = cat.filter;
+        prefilters[ncandidates] = cat.prefilter;
+        scores[ncandidates] = ranking_scores[i];
+        ncandidates++;
+    }
+
+    return ncandidates;
+}
+
+int btune_model_learn(blosc2_context * ctx, btune_comp_mode btune_comp, int ntried,
+                      const int * compcodes, const uint8_t * filters, const uint8_t * prefilters,
+                      int winner)
+{
+    btune_struct *btune = (btune_struct *)ctx->btune_params;
+    int32_t nblocks = btune->probe_nblocks;
+    if (nblocks <= 0) {
+        return -1;
+    }
+    model_t *model = get_model(btune, btune_comp);
+    if (model == NULL) {
+        return -1;
+    }
+
+    // Label the outputs of the tried categories with whether they won the sweep
+    int labels[NCODECS];
+    int nlabels = 0;
+    for (int j = 0; j < NCODECS; j++) {
+        labels[j] = -1;
+        if (j >= model->metadata.ncategories) {
+            continue;
+        }
+        category_t cat = model->metadata.categories[j];
+        for (int i = 0; i < ntried; i++) {
+            if ((cat.codec == compcodes[i]) && (cat.filter == filters[i]) &&
+                (cat.prefilter == prefilters[i])) {
+                labels[j] = (i == winner);
+                nlabels++;
+                break;
+            }
+        }
+    }
+    if (nlabels == 0) {
+        return 0;
+    }
+
+    float correction[NCODECS][NFEATURES];
+    {
+        std::lock_guard<std::mutex> lock(model->correction_mutex);
+        memcpy(correction, model->correction, sizeof(correction));
+    }
+
+    std::unique_ptr<tflite::Interpreter> interpreter = acquire_interpreter(model);
+    CHECK(interpreter != nullptr);
+    const float *output;
+    int rc = invoke_model(interpreter.get(), btune->probe_instr, nblocks, &model->metadata, &output);
+    if (rc < 0) {
+        release_interpreter(model, std::move(interpreter));
+        return rc;
+    }
+
+    // One step of gradient descent on the log loss, averaged over the blocks so that
+    // every sweep weighs the same
+    float gradient[NCODECS][NFEATURES] = {};
+    const float *input = interpreter->typed_input_tensor<float>(0);
+    for (int i = 0; i < nblocks; i++) {
+        float features[NFEATURES] = {1, input[2 * i], input[2 * i + 1]};
+        for (int j = 0; j < NCODECS; j++) {
+            if (labels[j] < 0) {
+                continue;
+            }
+            float error = (float)labels[j] - correct_score(correction[j], features, output[j]);
+            for (int k = 0; k < NFEATURES; k++) {
+                gradient[j][k] += error * features[k];
+            }
+        }
+        output += NCODECS;
+    }
+    release_interpreter(model, std::move(interpreter));
+
+    float step = btune->config.learning_rate / (float)nblocks;
+    std::lock_guard<std::mutex> lock(model->correction_mutex);
+    for (int j = 0; j < NCODECS; j++) {
+        for (int k = 0; k < NFEATURES; k++) {
+            model->correction[j][k] += step * gradient[j][k];
+        }
+    }
+
+    return nlabels;
 }
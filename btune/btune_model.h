@@ -5,7 +5,24 @@
 extern "C" {
 #endif
 
-int btune_model_inference(blosc2_context * ctx, btune_comp_mode btune_comp, int * compcode, uint8_t * filter);
+// Run the entropy probe over the chunk in ctx, storing its per-block features in the btune_struct.
+// Returns the number of blocks probed, or a negative value on error.
+int btune_model_probe(blosc2_context * ctx);
+
+// Infer the best codecs and filters from the features of the last btune_model_probe() call.
+// Up to maxcandidates candidates are returned, the most confident first, with the filter
+// applied before each filter (0 for none) in prefilters and their mean softmax score in scores.
+// With online_learning the scores are corrected with what btune_model_learn() learnt.
+// Returns the number of candidates, or a negative value on error.
+int btune_model_inference(blosc2_context * ctx, btune_comp_mode btune_comp, int maxcandidates,
+                          int * compcodes, uint8_t * filters, uint8_t * prefilters, float * scores);
+
+// Train the online correction of the model with the features of the last btune_model_probe()
+// call and the ntried codec/filter pipelines of a CODEC_FILTER sweep, of which winner won.
+// Returns the number of model categories trained, or a negative value on error.
+int btune_model_learn(blosc2_context * ctx, btune_comp_mode btune_comp, int ntried,
+                      const int * compcodes, const uint8_t * filters, const uint8_t * prefilters,
+                      int winner);
 
 #ifdef __cplusplus
 }
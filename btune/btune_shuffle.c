@@ -0,0 +1,69 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "btune_shuffle.h"
+
+
+#define MAX_PERIOD 16
+// The differences at a period and its multiples must be below this fraction of the
+// mean differences at the other lags
+#define PERIOD_GAIN 0.75
+
+// Sum of the absolute differences between the bytes and the ones lag bytes before them.
+// The sample is small enough for the sum to fit in 32 bits, which lets the loop vectorize.
+static uint32_t lag_sad(const uint8_t *src, int32_t size, int32_t lag) {
+  uint32_t sad = 0;
+  for (int32_t i = lag; i < size; i++) {
+    int diff = (int) src[i] - (int) src[i - lag];
+    sad += (uint32_t) (diff < 0 ? -diff : diff);
+  }
+  return sad;
+}
+
+int32_t btune_detect_shufflesize(const uint8_t * src, int32_t size, int32_t max_period) {
+  if (max_period > MAX_PERIOD) {
+    max_period = MAX_PERIOD;
+  }
+  if ((src == NULL) || (max_period < 2) || (size < 4 * max_period)) {
+    return 1;
+  }
+  if (size > BTUNE_SHUFFLE_SAMPLE_SIZE) {
+    src += (size - BTUNE_SHUFFLE_SAMPLE_SIZE) / 2;
+    size = BTUNE_SHUFFLE_SAMPLE_SIZE;
+  }
+
+  // Mean differences per lag, so that lags compare the same number of bytes
+  double sads[MAX_PERIOD + 1];
+  for (int32_t lag = 1; lag <= max_period; lag++) {
+    sads[lag] = (double) lag_sad(src, size, lag) / (double) (size - lag);
+  }
+
+  // The smallest lag whose multiples are all clearly more similar than the other lags
+  for (int32_t period = 2; period <= max_period; period++) {
+    double others = 0;
+    for (int32_t lag = 1; lag <= max_period; lag++) {
+      if (lag % period != 0) {
+        others += sads[lag];
+      }
+    }
+    others /= (double) (max_period - max_period / period);
+    bool periodic = true;
+    for (int32_t multiple = period; multiple <= max_period; multiple += period) {
+      periodic = periodic && (sads[multiple] < PERIOD_GAIN * others);
+    }
+    if (periodic) {
+      return period;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,23 @@
+#ifndef BTUNE_SHUFFLE_H
+#define BTUNE_SHUFFLE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of bytes of the sample used to detect the shufflesize
+#define BTUNE_SHUFFLE_SAMPLE_SIZE (64 * 1024)
+
+// Detect the element size of structured data from the periodicity of its bytes: the smallest
+// lag up to max_period (at most 16) such that the bytes differ from the ones that lag (or a
+// multiple of it) before them clearly less than for the other lags.  The differences are
+// computed on a sample from the center of src.  Returns 1 when the data shows no periodicity.
+int32_t btune_detect_shufflesize(const uint8_t * src, int32_t size, int32_t max_period);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_SHUFFLE_H */